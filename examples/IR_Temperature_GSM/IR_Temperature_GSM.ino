@@ -121,3 +121,6 @@ VRPC_GLOBAL_FUNCTION(String, getSignalStrength);
 VRPC_GLOBAL_FUNCTION(String, getLocation);
 VRPC_GLOBAL_FUNCTION(long, getAltitude);
 VRPC_GLOBAL_FUNCTION(long, getAccuracy);
+
+// keeps about 80 minutes of history, also while the link is down
+VRPC_TIME_SERIES(getObjectTemperature, 5000, 0.01, 1024);
@@ -0,0 +1,216 @@
+// Host stand-in for the Arduino core, just enough to build vrpc.h on a PC.
+// Nothing in here allocates from the heap after the first use, such that
+// heap allocations counted by the benchmark stem from VRPC or ArduinoJson.
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// On a board ArduinoJson supports String because ARDUINO is defined
+#ifndef ARDUINOJSON_ENABLE_ARDUINO_STRING
+#define ARDUINOJSON_ENABLE_ARDUINO_STRING 1
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+
+typedef uint8_t byte;
+
+#define HEX 16
+#define F(string_literal) (string_literal)
+
+class String {
+  std::string _s;
+
+ public:
+  String() {}
+  String(const char* s) : _s(s ? s : "") {}
+  String(const std::string& s) : _s(s) {}
+  String(char c) : _s(1, c) {}
+  String(int value, int base = 10) { format(base == HEX ? "%x" : "%d", value); }
+  String(unsigned int value, int base = 10) {
+    format(base == HEX ? "%x" : "%u", value);
+  }
+  String(long value) { format("%ld", value); }
+  String(unsigned long value) { format("%lu", value); }
+  String(float value) { format("%.2f", value); }
+  String(double value) { format("%.2f", value); }
+
+  unsigned int length() const { return _s.size(); }
+  const char* c_str() const { return _s.c_str(); }
+  bool reserve(unsigned int size) {
+    _s.reserve(size);
+    return true;
+  }
+
+  char operator[](unsigned int index) const { return _s[index]; }
+  char& operator[](unsigned int index) { return _s[index]; }
+
+  String substring(unsigned int from) const { return _s.substr(from); }
+  String substring(unsigned int from, unsigned int to) const {
+    return _s.substr(from, to - from);
+  }
+  int indexOf(char c, unsigned int from = 0) const {
+    const size_t found = _s.find(c, from);
+    return found == std::string::npos ? -1 : int(found);
+  }
+  bool startsWith(const String& prefix) const {
+    return _s.compare(0, prefix._s.size(), prefix._s) == 0;
+  }
+
+  bool concat(const char* s) {
+    _s += s;
+    return true;
+  }
+  bool concat(const String& s) {
+    _s += s._s;
+    return true;
+  }
+  bool concat(char c) {
+    _s += c;
+    return true;
+  }
+  String& operator+=(const String& s) {
+    concat(s);
+    return *this;
+  }
+  String& operator+=(const char* s) {
+    concat(s);
+    return *this;
+  }
+  String& operator+=(char c) {
+    concat(c);
+    return *this;
+  }
+
+  bool operator==(const String& other) const { return _s == other._s; }
+  bool operator==(const char* other) const { return _s == other; }
+  bool operator!=(const String& other) const { return _s != other._s; }
+  bool operator!=(const char* other) const { return _s != other; }
+  bool operator<(const String& other) const { return _s < other._s; }
+
+ private:
+  template <typename T>
+  void format(const char* format, T value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), format, value);
+    _s = buffer;
+  }
+};
+
+// Result of a concatenation in the Arduino core, ArduinoJson refers to it
+class StringSumHelper : public String {
+ public:
+  StringSumHelper(const String& s) : String(s) {}
+};
+
+inline StringSumHelper operator+(const String& lhs, const String& rhs) {
+  String sum(lhs);
+  sum += rhs;
+  return sum;
+}
+
+inline StringSumHelper operator+(const String& lhs, const char* rhs) {
+  String sum(lhs);
+  sum += rhs;
+  return sum;
+}
+
+inline StringSumHelper operator+(const char* lhs, const String& rhs) {
+  String sum(lhs);
+  sum += rhs;
+  return sum;
+}
+
+// Writes to stdout, without formatting through String
+class HardwareSerial {
+ public:
+  void begin(unsigned long) {}
+  void print(const char* s) { fputs(s, stdout); }
+  void print(const String& s) { fputs(s.c_str(), stdout); }
+  void print(char c) { fputc(c, stdout); }
+  void print(int value) { printf("%d", value); }
+  void print(unsigned int value) { printf("%u", value); }
+  void print(long value) { printf("%ld", value); }
+  void print(unsigned long value) { printf("%lu", value); }
+  void print(double value) { printf("%.2f", value); }
+  template <typename T>
+  void println(const T& value) {
+    print(value);
+    println();
+  }
+  void println() { fputc('\n', stdout); }
+};
+
+static HardwareSerial Serial;
+
+inline unsigned long micros() {
+  static const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+inline unsigned long millis() {
+  return micros() / 1000;
+}
+
+inline void delay(unsigned long ms) {
+  const unsigned long start = millis();
+  while (millis() - start < ms) {
+  }
+}
+
+inline void yield() {}
+
+inline long random(long max) {
+  return max > 0 ? rand() % max : 0;
+}
+
+inline long random(long min, long max) {
+  return min + random(max - min);
+}
+
+inline void randomSeed(unsigned long seed) {
+  srand(seed);
+}
+
+struct IPAddress {};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+};
+
+class Client : public Stream {
+ public:
+  virtual int connect(IPAddress ip, uint16_t port) = 0;
+  virtual int connect(const char* host, uint16_t port) = 0;
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int read(uint8_t* buffer, size_t size) = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+  virtual void stop() = 0;
+  virtual uint8_t connected() = 0;
+  virtual operator bool() = 0;
+};
+
+#endif
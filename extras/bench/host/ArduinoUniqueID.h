@@ -0,0 +1,10 @@
+// Host stand-in for ArduinoUniqueID
+
+#ifndef HOST_ARDUINO_UNIQUE_ID_H
+#define HOST_ARDUINO_UNIQUE_ID_H
+
+#include <Arduino.h>
+
+static uint8_t UniqueID8[8] = {1, 2, 3, 4, 5, 6, 7, 0xab};
+
+#endif
@@ -0,0 +1,119 @@
+// Host stand-in for PubSubClient. A broker is simulated by counting what the
+// agent connects, publishes and subscribes, and by delivering messages to it.
+// It does not allocate from the heap.
+
+#ifndef HOST_PUB_SUB_CLIENT_H
+#define HOST_PUB_SUB_CLIENT_H
+
+#include <Arduino.h>
+
+class PubSubClient {
+ public:
+  typedef void (*Callback)(char* topic, uint8_t* payload, unsigned int length);
+  typedef void (*Observer)(const char* topic,
+                           const char* payload,
+                           bool retained);
+
+  // Broker side, inspected and controlled by the host program
+  bool accept_connect = true;
+  bool accept_subscribe = true;
+  bool clean_session = true;
+  unsigned int connects = 0;
+  unsigned int publishes = 0;
+  unsigned int retained_publishes = 0;
+  unsigned int subscribes = 0;
+  Observer on_publish = nullptr;
+
+  bool setBufferSize(uint16_t size) { return size <= sizeof(_buffer); }
+  PubSubClient& setClient(Client& client) {
+    _client = &client;
+    return *this;
+  }
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setKeepAlive(uint16_t) { return *this; }
+  PubSubClient& setCallback(Callback callback) {
+    _callback = callback;
+    return *this;
+  }
+
+  bool connect(const char* id,
+               const char* user,
+               const char* pass,
+               const char* willTopic,
+               uint8_t willQos,
+               bool willRetain,
+               const char* willMessage,
+               bool cleanSession) {
+    (void)id, (void)user, (void)pass, (void)willTopic, (void)willQos,
+        (void)willRetain, (void)willMessage;
+    if (!accept_connect)
+      return false;
+    clean_session = cleanSession;
+    _connected = true;
+    ++connects;
+    if (_client != nullptr) {
+      _client->connect("broker", 1883);
+      send(20);
+    }
+    return true;
+  }
+
+  void disconnect() { _connected = false; }
+
+  // Simulates a lost connection
+  void drop() { _connected = false; }
+
+  bool connected() { return _connected; }
+  bool loop() { return _connected; }
+  int state() { return _connected ? 0 : -3; }
+
+  bool publish(const char* topic, const char* payload, bool retained = false) {
+    if (!_connected)
+      return false;
+    ++publishes;
+    if (retained)
+      ++retained_publishes;
+    send(strlen(topic) + strlen(payload) + 4);
+    if (on_publish != nullptr)
+      on_publish(topic, payload, retained);
+    return true;
+  }
+
+  bool subscribe(const char* topic, uint8_t qos = 0) {
+    (void)qos;
+    if (!_connected || !accept_subscribe)
+      return false;
+    ++subscribes;
+    send(strlen(topic) + 7);
+    return true;
+  }
+
+  // Delivers a message to the agent as the broker would
+  void deliver(const char* topic, const char* payload) {
+    const size_t topic_length = strlen(topic);
+    const size_t payload_length = strlen(payload);
+    if (topic_length + 1 + payload_length > sizeof(_buffer))
+      return;
+    memcpy(_buffer, topic, topic_length + 1);
+    uint8_t* data = reinterpret_cast<uint8_t*>(_buffer + topic_length + 1);
+    memcpy(data, payload, payload_length);
+    _callback(_buffer, data, payload_length);
+  }
+
+ private:
+  void send(size_t size) {
+    static const uint8_t zeros[64] = {0};
+    while (size > 0 && _client != nullptr) {
+      const size_t chunk = size < sizeof(zeros) ? size : sizeof(zeros);
+      _client->write(zeros, chunk);
+      size -= chunk;
+    }
+  }
+
+  Client* _client = nullptr;
+  Callback _callback = nullptr;
+  bool _connected = false;
+  char _buffer[4096];
+};
+
+#endif
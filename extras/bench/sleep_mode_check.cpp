@@ -0,0 +1,102 @@
+// VRPC - vrpc.io
+// Copyright Dr. Burkhard Heisen 2021
+// MIT License
+
+// Checks on a PC that the sleep mode resumes its persistent session without
+// announcing or subscribing again, against the broker simulated by the
+// PubSubClient stand-in in `host`. Built like the benchmark:
+//
+//   g++ -std=c++11 -Ihost -I$JSON -I../../src sleep_mode_check.cpp -o check
+//   ./check > /dev/null
+//
+// Failed checks are reported on stderr and by the exit code.
+
+#include <Arduino.h>
+
+#include <vrpc.h>
+
+int add(int a, int b) {
+  return a + b;
+}
+
+VRPC_GLOBAL_FUNCTION(int, add, int, int);
+
+struct NullClient : Client {
+  int connect(IPAddress, uint16_t) override { return 1; }
+  int connect(const char*, uint16_t) override { return 1; }
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t size) override { return size; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int read(uint8_t*, size_t) override { return -1; }
+  int peek() override { return -1; }
+  void flush() override {}
+  void stop() override {}
+  uint8_t connected() override { return 1; }
+  operator bool() override { return true; }
+};
+
+static int failures = 0;
+
+// Connects as a sketch does, calling loop first, and checks what was sent
+void expect_connect(VrpcAgent& agent,
+                    const char* what,
+                    unsigned int publishes,
+                    unsigned int subscribes) {
+  PubSubClient& broker = vrpc::client;
+  const unsigned int published = broker.publishes;
+  const unsigned int subscribed = broker.subscribes;
+  agent.loop();
+  if (!agent.connected())
+    agent.connect();
+  const unsigned int p = broker.publishes - published;
+  const unsigned int s = broker.subscribes - subscribed;
+  const bool ok = agent.connected() && !broker.clean_session &&
+                  p == publishes && s == subscribes &&
+                  agent.session_established();
+  fprintf(stderr, "%s %s: %u publishes, %u subscribes, established %d\n",
+          ok ? "PASS" : "FAIL", what, p, s, agent.session_established());
+  if (!ok)
+    ++failures;
+}
+
+void fail_once(VrpcAgent& agent) {
+  vrpc::client.accept_connect = false;
+  agent.loop();
+  agent.connect();
+  vrpc::client.accept_connect = true;
+}
+
+int main() {
+  NullClient net;
+  VrpcAgent agent;
+  agent.begin(net, "check");
+
+  // woken from deep sleep, the session was established before the reset
+  agent.enable_sleep_mode(true);
+  expect_connect(agent, "deep sleep resume", 0, 0);
+
+  // sleeping without a reset, waking up on the second attempt (e.g. GSM)
+  agent.sleep();
+  agent.loop();
+  fail_once(agent);
+  expect_connect(agent, "wake-up after a failed connect", 0, 0);
+
+  // a lost connection published the will, the session may be gone
+  vrpc::client.drop();
+  expect_connect(agent, "reconnect after a connection loss", 1, 2);
+
+  // a new session, whose subscriptions fail at first
+  agent.sleep();
+  agent.enable_sleep_mode(false);
+  vrpc::client.accept_subscribe = false;
+  agent.connect();
+  vrpc::client.accept_subscribe = true;
+  if (agent.session_established()) {
+    fprintf(stderr, "FAIL established without subscriptions\n");
+    ++failures;
+  }
+  agent.sleep();
+  expect_connect(agent, "subscription retry", 0, 2);
+  return failures == 0 ? 0 : 1;
+}
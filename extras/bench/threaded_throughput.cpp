@@ -0,0 +1,150 @@
+// VRPC - vrpc.io
+// Copyright Dr. Burkhard Heisen 2021
+// MIT License
+
+// Compares the call throughput and the longest `loop` of the default and the
+// threaded mode on a PC and counts the heap allocations per call. The Arduino
+// core, PubSubClient and ArduinoUniqueID are replaced by the stand-ins in
+// `host`, ArduinoJson 6 is the real library (header-only):
+//
+//   JSON=path/to/ArduinoJson/src
+//   g++ -std=c++11 -O2 -Ihost -I$JSON -I../../src threaded_throughput.cpp
+//       -o single
+//   g++ -std=c++11 -O2 -pthread -DVRPC_THREADED -Ihost -I$JSON -I../../src
+//       threaded_throughput.cpp -o threaded
+//   ./single 20 > /dev/null && ./threaded 20 > /dev/null
+//
+// Arguments: the work per call (thousands of loop iterations, default 20) and
+// the number of calls (default 2000). A new call arrives whenever the
+// scheduler is empty, as a broker delivering a steady stream would. The
+// result goes to stderr, the serial log of the agent to stdout.
+//
+// Heap allocations are counted by replacing malloc, calloc and realloc
+// (glibc), on all threads from the first call delivered until the last
+// reply. The stand-ins do not allocate, so the count is the one of VRPC and
+// ArduinoJson.
+
+#include <Arduino.h>
+
+#define VRPC_MAX_PENDING_CALLS 8
+#include <vrpc.h>
+
+#include <atomic>
+#include <chrono>
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+}
+
+static std::atomic<bool> counting(false);
+static std::atomic<long> allocations(0);
+
+extern "C" void* malloc(size_t size) {
+  if (counting)
+    ++allocations;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  if (counting)
+    ++allocations;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* p, size_t size) {
+  if (counting)
+    ++allocations;
+  return __libc_realloc(p, size);
+}
+
+volatile long sink;
+
+int work(int n) {
+  long x = 0;
+  for (int i = 0; i < n * 1000; ++i)
+    x += i % 7;
+  sink = x;
+  return n * 2;
+}
+
+VRPC_GLOBAL_FUNCTION(int, work, int);
+
+struct NullClient : Client {
+  int connect(IPAddress, uint16_t) override { return 1; }
+  int connect(const char*, uint16_t) override { return 1; }
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t size) override { return size; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int read(uint8_t*, size_t) override { return -1; }
+  int peek() override { return -1; }
+  void flush() override {}
+  void stop() override {}
+  uint8_t connected() override { return 1; }
+  operator bool() override { return true; }
+};
+
+static char expected[16];
+static int replies = 0;
+static int failed = 0;
+
+void check_reply(const char* topic, const char* payload, bool) {
+  if (strcmp(topic, "bench/client") != 0)
+    return;
+  ++replies;
+  if (strstr(payload, expected) == nullptr)
+    ++failed;
+}
+
+int main(int argc, char** argv) {
+  typedef std::chrono::steady_clock Clock;
+  const int n = argc > 1 ? atoi(argv[1]) : 20;
+  const int calls = argc > 2 ? atoi(argv[2]) : 2000;
+  snprintf(expected, sizeof(expected), "\"r\":%d", n * 2);
+
+  NullClient net;
+  VrpcAgent agent;
+  agent.begin(net, "bench");
+  agent.connect();
+  vrpc::client.on_publish = check_reply;
+  const char* topic = "bench/ar01020304050607ab/__global__/__static__/work";
+
+  int sent = 0;
+  Clock::duration longest_loop(0);
+  const Clock::time_point start = Clock::now();
+  counting = true;
+  while (replies < calls) {
+    if (sent < calls && vrpc::init<vrpc::Scheduler>().empty()) {
+      char payload[64];
+      snprintf(payload, sizeof(payload),
+               "{\"a\":[%d],\"s\":\"bench/client\",\"i\":\"%d\"}", n, sent);
+      vrpc::client.deliver(topic, payload);
+      ++sent;
+    }
+    const Clock::time_point before = Clock::now();
+    agent.loop();
+    const Clock::duration took = Clock::now() - before;
+    if (took > longest_loop)
+      longest_loop = took;
+  }
+  counting = false;
+  const Clock::duration total = Clock::now() - start;
+
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  const long total_us = duration_cast<microseconds>(total).count();
+  fprintf(stderr,
+          "%s: work=%d calls=%d failed=%d total=%ldms per_call=%ldus "
+          "longest_loop=%ldus allocations_per_call=%.2f\n",
+#ifdef VRPC_THREADED
+          "threaded",
+#else
+          "single",
+#endif
+          n, calls, failed, total_us / 1000, total_us / calls,
+          long(duration_cast<microseconds>(longest_loop).count()),
+          double(allocations) / calls);
+  return failed == 0 ? 0 : 1;
+}
@@ -13,9 +13,106 @@
 
 #include <ArduinoJson.h>
 #include <PubSubClient.h>
-#include <map>
 #include <vector>
 
+// The ATmega4809 has 6 KB of RAM, PubSubClient already takes the message size
+#ifdef ARDUINO_ARCH_MEGAAVR
+#ifndef VRPC_MAX_PENDING_CALLS
+#define VRPC_MAX_PENDING_CALLS 1
+#endif
+#ifndef VRPC_ARENA_SIZE
+#define VRPC_ARENA_SIZE 1024
+#endif
+#ifndef VRPC_JSON_CAPACITY
+#define VRPC_JSON_CAPACITY 512
+#endif
+#ifndef VRPC_CONNECT_BUFFER_SIZE
+#define VRPC_CONNECT_BUFFER_SIZE 384
+#endif
+#ifndef VRPC_MAX_CLASSES
+#define VRPC_MAX_CLASSES 2
+#endif
+#ifndef VRPC_FUNCTION_TABLE_SIZE
+#define VRPC_FUNCTION_TABLE_SIZE 32
+#endif
+#endif
+
+// Maximum number of calls that may wait for execution, each one takes a
+// buffer of the maximum message size
+#ifndef VRPC_MAX_PENDING_CALLS
+#define VRPC_MAX_PENDING_CALLS 4
+#endif
+
+// Size of the arena holding all temporaries of a single message
+#ifndef VRPC_ARENA_SIZE
+#define VRPC_ARENA_SIZE 2048
+#endif
+
+// Capacity of the JSON document used to process a message
+#ifndef VRPC_JSON_CAPACITY
+#define VRPC_JSON_CAPACITY 1024
+#endif
+
+// Size of the buffer holding all topics and payloads needed on (re-)connect
+#ifndef VRPC_CONNECT_BUFFER_SIZE
+#define VRPC_CONNECT_BUFFER_SIZE 512
+#endif
+
+// Maximum number of classes announced by the agent
+#ifndef VRPC_MAX_CLASSES
+#define VRPC_MAX_CLASSES 4
+#endif
+
+// Slots of the hash table resolving calls, a power of two of at least four
+// times the number of registered functions (incl. the 4 built-in functions)
+#ifndef VRPC_FUNCTION_TABLE_SIZE
+#define VRPC_FUNCTION_TABLE_SIZE 64
+#endif
+
+// Maximum number of buckets a time series query is downsampled to
+#ifndef VRPC_TIME_SERIES_MAX_BUCKETS
+#define VRPC_TIME_SERIES_MAX_BUCKETS 16
+#endif
+
+// Define VRPC_THREADED to execute calls on a worker thread (ESP32: a task on
+// the other core) while the thread calling loop keeps the transport
+#ifdef VRPC_THREADED
+
+#ifdef ARDUINO_ARCH_MEGAAVR
+#error "VRPC_THREADED is not supported on this architecture"
+#endif
+
+// Number of calls held by the worker thread, each takes VRPC_ARENA_SIZE bytes
+#ifndef VRPC_WORKER_SLOTS
+#define VRPC_WORKER_SLOTS 2
+#endif
+
+// Stack size of the worker task (ESP32)
+#ifndef VRPC_WORKER_STACK_SIZE
+#define VRPC_WORKER_STACK_SIZE 8192
+#endif
+
+// Core the worker task is pinned to (ESP32)
+#ifndef VRPC_WORKER_CORE
+#define VRPC_WORKER_CORE 0
+#endif
+
+#include <atomic>
+#ifdef ARDUINO_ARCH_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#define VRPC_THREAD_LOCAL thread_local
+#else
+#define VRPC_THREAD_LOCAL
+#endif  // VRPC_THREADED
+
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
 namespace vrpc {
@@ -24,7 +121,40 @@ PubSubClient client;
 
 const String compile_date = __DATE__ " " __TIME__;
 
-typedef DynamicJsonDocument Json;
+/**
+ * 32-bit FNV-1a hash
+ * @param s Null-terminated string to be hashed
+ * @param h Hash to continue from
+ */
+inline uint32_t hash(const char* s, uint32_t h = 2166136261u) {
+  for (; *s; ++s) {
+    h = (h ^ uint8_t(*s)) * 16777619u;
+  }
+  return h;
+}
+
+// Adds a single byte to an FNV-1a hash
+constexpr uint32_t mix(uint32_t h, uint8_t c) {
+  return (h ^ c) * 16777619u;
+}
+
+// FNV-1a hash, usable at compile time (intended for short strings)
+constexpr uint32_t static_hash(const char* s, uint32_t h = 2166136261u) {
+  return *s ? static_hash(s + 1, mix(h, *s)) : h;
+}
+
+/**
+ * Hash of a function's context and name, the signature hash continues from
+ * it with one type code per argument
+ */
+constexpr uint32_t function_hash(const char* context, const char* name) {
+  return static_hash(name, mix(static_hash(context), '/'));
+}
+
+// Key of a function regardless of its arguments, never a signature hash
+constexpr uint32_t name_key(const char* context, const char* name) {
+  return mix(function_hash(context, name), '*');
+}
 
 // Singleton helper
 template <typename T>
@@ -33,6 +163,107 @@ inline T& init() {
   return t;
 }
 
+/**
+ * Fixed-size bump allocator for all temporaries needed while processing a
+ * single message. Memory is given back in bulk by leaving a Scope, which
+ * keeps the heap footprint constant no matter how many messages arrive.
+ */
+class Arena {
+  friend Arena& init<Arena>();
+
+  alignas(void*) char _buffer[VRPC_ARENA_SIZE];
+  size_t _size = 0;
+  size_t _last = VRPC_ARENA_SIZE;
+
+ public:
+  /**
+   * Restores the arena to the state it had on construction of the scope
+   */
+  class Scope {
+    Arena& _arena;
+    size_t _mark;
+
+   public:
+    Scope() : _arena(Arena::current()), _mark(_arena._size) {}
+    ~Scope() { _arena.release(_mark); }
+  };
+
+  // The arena of the calling thread (see VRPC_THREADED)
+  static Arena*& pointer() {
+    static VRPC_THREAD_LOCAL Arena* arena = &init<Arena>();
+    return arena;
+  }
+
+  static Arena& current() { return *pointer(); }
+
+  void release(size_t mark) {
+    _size = mark;
+    // the most recent allocation is gone, nothing can be given back early
+    _last = VRPC_ARENA_SIZE;
+  }
+
+  void* allocate(size_t n) {
+    const size_t start = (_size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+    if (start + n > VRPC_ARENA_SIZE) {
+      Serial.println("ERROR [VRPC] Arena exhausted, increase VRPC_ARENA_SIZE");
+      return nullptr;
+    }
+    _last = start;
+    _size = start + n;
+    return _buffer + start;
+  }
+
+  void deallocate(void* p) {
+    // only the most recent allocation can be given back early
+    if (p == _buffer + _last)
+      _size = _last;
+  }
+
+  void* reallocate(void* p, size_t n) {
+    if (p == _buffer + _last && _last + n <= VRPC_ARENA_SIZE) {
+      _size = _last + n;
+      return p;
+    }
+    // the old size is unknown, copy at most up to the current end
+    const size_t available =
+        p != nullptr ? _buffer + _size - static_cast<char*>(p) : 0;
+    void* q = allocate(n);
+    if (q != nullptr && available > 0) {
+      memcpy(q, p, n < available ? n : available);
+    }
+    return q;
+  }
+
+  char* copy(const char* s) { return concat(s, ""); }
+
+  char* concat(const char* s1, const char* s2) {
+    const size_t n1 = strlen(s1);
+    const size_t n2 = strlen(s2);
+    char* s = static_cast<char*>(allocate(n1 + n2 + 1));
+    if (s != nullptr) {
+      memcpy(s, s1, n1);
+      memcpy(s + n1, s2, n2 + 1);
+    }
+    return s;
+  }
+};
+
+// Lets ArduinoJson allocate its memory pool from the arena
+struct ArenaAllocator {
+  Arena* arena;  // nullptr uses the arena of the calling thread
+
+  ArenaAllocator(Arena* arena = nullptr) : arena(arena) {}
+
+  void* allocate(size_t n) { return get().allocate(n); }
+  void deallocate(void* p) { get().deallocate(p); }
+  void* reallocate(void* p, size_t n) { return get().reallocate(p, n); }
+
+ private:
+  Arena& get() const { return arena != nullptr ? *arena : Arena::current(); }
+};
+
+typedef BasicJsonDocument<ArenaAllocator> Json;
+
 namespace details {
 
 // The code below was formulated as an answer to StackOverflow and can be read
@@ -79,171 +310,1317 @@ R call(F f, Tuple&& t) {
 
 namespace details {
 
+typedef JsonArrayConst::iterator ArgIterator;
+
 template <size_t N, typename Ret, typename... Args>
 struct unpack_impl;
 
 template <size_t N, typename Ret, typename Arg, typename... Args>
 struct unpack_impl<N, Ret, Arg, Args...> {
   template <typename A = Arg, typename R = Ret>
-  static void unpack(const Json& j, R& t) {
+  static void unpack(ArgIterator it, const ArgIterator& end, R& t) {
     typedef typename notstd::decay<A>::type dA;
-    notstd::get<N>(t) = j["a"][N].as<dA>();
-    unpack_impl<N + 1, Ret, Args...>::unpack(j, t);
-  }
-};
-
-template <size_t N, typename Ret, typename Arg>
-struct unpack_impl<N, Ret, Arg> {
-  template <typename A = Arg, typename R = Ret>
-  static void unpack(const Json& j, R& t) {
-    typedef typename notstd::decay<A>::type dA;
-    notstd::get<N>(t) = j["a"][N].as<dA>();
+    if (it == end) {
+      // Missing arguments are default constructed, as if they were null
+      notstd::get<N>(t) = dA();
+      unpack_impl<N + 1, Ret, Args...>::unpack(it, end, t);
+      return;
+    }
+    notstd::get<N>(t) = (*it).template as<dA>();
+    unpack_impl<N + 1, Ret, Args...>::unpack(++it, end, t);
   }
 };
 
 template <size_t N, typename Ret>
 struct unpack_impl<N, Ret> {
   template <typename R = Ret>
-  static void unpack(const Json&, R&) {
+  static void unpack(const ArgIterator&, const ArgIterator&, R&) {
     // Do nothing
   }
 };
 
 }  // namespace details
 
+/**
+ * Converts the call arguments (`a`) into a tuple in a single pass
+ * @param j The JSON request
+ */
 template <typename... Args>
 notstd::tuple<Args...> unpack(const Json& j) {
   typedef typename notstd::tuple<Args...> Ret;
   Ret t;
-  details::unpack_impl<0, Ret, Args...>::unpack(j, t);
+  JsonArrayConst args = j["a"].template as<JsonArrayConst>();
+  details::unpack_impl<0, Ret, Args...>::unpack(args.begin(), args.end(), t);
   return t;
 }
 
-class AbstractFunction {
+// Type codes of arguments, as distinguishable in JSON
+
+template <typename T>
+struct TypeCode {
+  static const uint8_t value = 'v';  // only reachable by name
+};
+
+#define VRPC_TYPE_CODE(Type, Code)     \
+  template <>                          \
+  struct TypeCode<Type> {              \
+    static const uint8_t value = Code; \
+  };
+
+VRPC_TYPE_CODE(bool, 'b')
+VRPC_TYPE_CODE(char, 'n')
+VRPC_TYPE_CODE(signed char, 'n')
+VRPC_TYPE_CODE(unsigned char, 'n')
+VRPC_TYPE_CODE(short, 'n')
+VRPC_TYPE_CODE(unsigned short, 'n')
+VRPC_TYPE_CODE(int, 'n')
+VRPC_TYPE_CODE(unsigned int, 'n')
+VRPC_TYPE_CODE(long, 'n')
+VRPC_TYPE_CODE(unsigned long, 'n')
+VRPC_TYPE_CODE(long long, 'n')
+VRPC_TYPE_CODE(unsigned long long, 'n')
+VRPC_TYPE_CODE(float, 'n')
+VRPC_TYPE_CODE(double, 'n')
+VRPC_TYPE_CODE(String, 's')
+VRPC_TYPE_CODE(const char*, 's')
+VRPC_TYPE_CODE(char*, 's')
+VRPC_TYPE_CODE(JsonArray, 'a')
+VRPC_TYPE_CODE(JsonArrayConst, 'a')
+VRPC_TYPE_CODE(JsonObject, 'o')
+VRPC_TYPE_CODE(JsonObjectConst, 'o')
+
+#undef VRPC_TYPE_CODE
+
+inline uint8_t type_code(JsonVariantConst arg) {
+  if (arg.is<bool>())
+    return 'b';
+  if (arg.is<float>())  // integers included
+    return 'n';
+  if (arg.is<const char*>())
+    return 's';
+  if (arg.is<JsonArrayConst>())
+    return 'a';
+  if (arg.is<JsonObjectConst>())
+    return 'o';
+  return 'z';  // null
+}
+
+// Continues a function hash with the type codes of the argument types
+template <typename... Args>
+struct Signature;
+
+template <>
+struct Signature<> {
+  static constexpr uint32_t hash(uint32_t h) { return h; }
+};
+
+template <typename Arg, typename... Args>
+struct Signature<Arg, Args...> {
+  static constexpr uint32_t hash(uint32_t h) {
+    return Signature<Args...>::hash(
+        mix(h, TypeCode<typename notstd::decay<Arg>::type>::value));
+  }
+};
+
+typedef void (*Thunk)(Json&);
+
+/**
+ * Registration record of a single function, statically allocated together
+ * with its registrar
+ */
+struct FunctionEntry {
+  const char* context;
+  const char* name;
+  Thunk thunk;
+  uint32_t signature;  // hash of context, name and argument types
+  FunctionEntry* next;
+  uint32_t bytes_in;   // calls as received
+  uint32_t bytes_out;  // replies as sent
+};
+
+template <typename Func, Func f, typename R, typename... Args>
+struct GlobalFunction {
+  static void invoke(Json& j) { j["r"] = call<R>(f, unpack<Args...>(j)); }
+};
+
+template <typename Func, Func f, typename... Args>
+struct GlobalFunction<Func, f, void, Args...> {
+  static void invoke(Json& j) {
+    call<void>(f, unpack<Args...>(j));
+    j["r"] = nullptr;
+  }
+};
+
+/**
+ * Keeps all registered functions. Calls are resolved through an open
+ * addressing hash table, keyed by the signature hash of every function and by
+ * the function hash of the first function declared with a name.
+ */
+class Registry {
+  friend Registry& init<Registry>();
+
+  static_assert((VRPC_FUNCTION_TABLE_SIZE & (VRPC_FUNCTION_TABLE_SIZE - 1)) ==
+                    0,
+                "VRPC_FUNCTION_TABLE_SIZE must be a power of two");
+
+  struct Slot {
+    uint32_t key;
+    FunctionEntry* entry;  // nullptr marks an empty slot
+  };
+
+  FunctionEntry* _functions = nullptr;
+  FunctionEntry* _last = nullptr;
+  Slot _table[VRPC_FUNCTION_TABLE_SIZE] = {};
+  size_t _keys = 0;
+  bool _overflow = false;  // not all functions are in the table
+
+ public:
+  static void register_function(FunctionEntry& entry) {
+    Registry& registry = init<Registry>();
+    // appending keeps the order of declaration
+    entry.next = nullptr;
+    if (registry._last != nullptr)
+      registry._last->next = &entry;
+    else
+      registry._functions = &entry;
+    registry._last = &entry;
+    // overloads must differ in the JSON types of their arguments, otherwise
+    // the first one declared is called
+    registry.insert(entry.signature, entry);
+    registry.insert(name_key(entry.context, entry.name), entry);
+  }
+
+  static FunctionEntry* get_functions() {
+    return init<Registry>()._functions;
+  }
+
+  /**
+   * Whether some functions did not fit the table, calls are refused then as
+   * they could be resolved to the wrong overload
+   */
+  static bool overflows() { return init<Registry>()._overflow; }
+
+  /**
+   * Finds the first function declared with the given name
+   */
+  static FunctionEntry* find(const char* context, const char* function_name) {
+    Registry& registry = init<Registry>();
+    FunctionEntry* entry = registry.lookup(name_key(context, function_name),
+                                           context, function_name);
+    if (entry != nullptr || !registry._overflow)
+      return entry;
+    for (FunctionEntry* it = registry._functions; it; it = it->next) {
+      if (strcmp(it->name, function_name) == 0 &&
+          strcmp(it->context, context) == 0) {
+        return it;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Finds the overload matching the JSON types of the arguments, or else the
+   * first function declared with the given name
+   */
+  static FunctionEntry* resolve(const char* context,
+                                const char* function_name,
+                                JsonArrayConst args) {
+    uint32_t signature = function_hash(context, function_name);
+    for (JsonVariantConst arg : args)
+      signature = mix(signature, type_code(arg));
+    FunctionEntry* entry =
+        init<Registry>().lookup(signature, context, function_name);
+    if (entry != nullptr && entry->signature == signature)
+      return entry;
+    // e.g. missing arguments, which are default constructed
+    return Registry::find(context, function_name);
+  }
+
+  static String call(const String& jsonString) {
+    Arena::Scope scope;
+    Json json(256);
+    DeserializationError err = deserializeJson(json, jsonString);
+    if (err) {
+      Serial.print(F("ERROR [VRPC] JSON parsing failed because: "));
+      Serial.println(err.c_str());
+      return String("{\"e\": \"JSON parsing failed because: ") +
+             String(err.c_str()) + String("\"}");
+    }
+    Registry::call(json);
+    String res;
+    serializeJson(json, res);
+    return res;
+  }
+
+  static void call(Json& json) {
+    if (Registry::overflows()) {
+      Serial.println(
+          "ERROR [VRPC] Function table full, increase "
+          "VRPC_FUNCTION_TABLE_SIZE");
+      json["e"] = "Function table full, increase VRPC_FUNCTION_TABLE_SIZE";
+      return;
+    }
+    const char* context = json["c"] | "";
+    const char* function_name = json["f"] | "";
+    const FunctionEntry* entry = Registry::resolve(
+        context, function_name, json["a"].as<JsonArrayConst>());
+    if (entry != nullptr) {
+      entry->thunk(json);
+    } else if (!Registry::has_context(context)) {
+      Serial.print("ERROR [VRPC] Could not find context: ");
+      Serial.println(context);
+      json["e"] = Arena::current().concat("Could not find context: ", context);
+    } else {
+      Serial.print("ERROR [VRPC] Could not find function: ");
+      Serial.println(function_name);
+      json["e"] =
+          Arena::current().concat("Could not find function: ", function_name);
+    }
+  }
+
+  static bool has_context(const char* context) {
+    for (const FunctionEntry* it = init<Registry>()._functions; it;
+         it = it->next) {
+      if (strcmp(it->context, context) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  static std::vector<const char*> get_classes() {
+    std::vector<const char*> classes;
+    for (const FunctionEntry* it = init<Registry>()._functions; it;
+         it = it->next) {
+      bool known = false;
+      for (const auto& class_name : classes) {
+        if (strcmp(class_name, it->context) == 0) {
+          known = true;
+          break;
+        }
+      }
+      if (!known)
+        classes.push_back(it->context);
+    }
+    return classes;
+  }
+
+  static std::vector<const char*> get_static_functions(
+      const char* class_name) {
+    std::vector<const char*> functions;
+    for (const FunctionEntry* it = init<Registry>()._functions; it;
+         it = it->next) {
+      // overloads are announced once
+      if (strcmp(class_name, it->context) == 0 &&
+          Registry::find(it->context, it->name) == it) {
+        functions.push_back(it->name);
+      }
+    }
+    return functions;
+  }
+
+ private:
+  void insert(uint32_t key, FunctionEntry& entry) {
+    size_t i = key & (VRPC_FUNCTION_TABLE_SIZE - 1);
+    for (; _table[i].entry != nullptr;
+         i = (i + 1) & (VRPC_FUNCTION_TABLE_SIZE - 1)) {
+      const FunctionEntry* other = _table[i].entry;
+      // first come, first served, unless the keys merely collide
+      if (_table[i].key == key && strcmp(other->name, entry.name) == 0 &&
+          strcmp(other->context, entry.context) == 0) {
+        return;
+      }
+    }
+    // one slot stays empty to terminate lookups
+    if (_keys + 1 == VRPC_FUNCTION_TABLE_SIZE) {
+      _overflow = true;
+      return;
+    }
+    _table[i] = Slot{key, &entry};
+    ++_keys;
+  }
+
+  FunctionEntry* lookup(uint32_t key,
+                        const char* context,
+                        const char* function_name) const {
+    for (size_t i = key & (VRPC_FUNCTION_TABLE_SIZE - 1);
+         _table[i].entry != nullptr;
+         i = (i + 1) & (VRPC_FUNCTION_TABLE_SIZE - 1)) {
+      const FunctionEntry* entry = _table[i].entry;
+      // guards against hash collisions
+      if (_table[i].key == key && strcmp(entry->name, function_name) == 0 &&
+          strcmp(entry->context, context) == 0) {
+        return _table[i].entry;
+      }
+    }
+    return nullptr;
+  }
+};
+
+class Scheduler {
+  friend Scheduler& init<Scheduler>();
+
+ public:
+  enum Flags : uint8_t {
+    BROADCAST = 1,  // received on a broadcast topic
+    EXECUTED = 2    // holds the reply of an executed call
+  };
+
+ private:
+  struct Policy {
+    const char* function_name = nullptr;  // as registered
+    uint8_t priority = 0;
+    float rate = 0;  // tokens per second, 0 means unlimited
+    float burst = 1;
+    float tokens = 1;
+    unsigned long last_refill = 0;
+  };
+
+  struct PendingCall {
+    char* request = nullptr;
+    uint32_t sequence = 0;
+    unsigned long due = 0;
+    uint8_t priority = 0;
+    uint8_t flags = 0;
+    bool used = false;
+  };
+
+  std::vector<Policy> _policies;
+  // the last slot is only used for a delayed reply, if reserved
+  PendingCall _pending[VRPC_MAX_PENDING_CALLS + 1];
+  char* _requests = nullptr;
+  size_t _request_size = 0;
+  size_t _reply_slots = 0;
+  uint32_t _sequence = 0;
+  size_t _size = 0;
+  size_t _replies = 0;  // pending calls flagged EXECUTED
+  unsigned long _budget = 0;
+
+ public:
+  /**
+   * Allocates the buffers of all pending calls, dropping queued ones
+   * @param request_size Size of a single serialized request, a call fits if
+   * its message fits the MQTT buffer as context and function name are taken
+   * from the topic
+   * @param reply_slot Whether to add a slot for a delayed reply, such that
+   * it does not keep a call from being queued
+   * @return false if the allocation failed, no call can be queued then
+   */
+  bool reserve(size_t request_size, bool reply_slot = false) {
+    const size_t slots = VRPC_MAX_PENDING_CALLS + (reply_slot ? 1 : 0);
+    char* requests =
+        static_cast<char*>(realloc(_requests, slots * request_size));
+    if (requests == nullptr) {
+      Serial.println("ERROR [VRPC] Not enough memory for pending calls");
+      return false;
+    }
+    _requests = requests;
+    _request_size = request_size;
+    _reply_slots = reply_slot ? 1 : 0;
+    for (size_t i = 0; i < VRPC_MAX_PENDING_CALLS + 1; ++i) {
+      _pending[i].request = i < slots ? _requests + i * request_size : nullptr;
+      _pending[i].used = false;
+    }
+    _size = _replies = 0;
+    return true;
+  }
+
+  size_t get_request_size() const { return _request_size; }
+
+  void set_rate_limit(const String& function_name,
+                      float calls_per_second,
+                      uint8_t burst) {
+    Policy* policy = get_policy(function_name.c_str(), true);
+    if (policy == nullptr)
+      return;
+    policy->rate = calls_per_second;
+    policy->burst = burst < 1 ? 1 : burst;
+    policy->tokens = policy->burst;
+    policy->last_refill = millis();
+  }
+
+  void set_priority(const String& function_name, uint8_t priority) {
+    Policy* policy = get_policy(function_name.c_str(), true);
+    if (policy != nullptr)
+      policy->priority = priority;
+  }
+
+  void set_budget(unsigned long budget) { _budget = budget; }
+
+  unsigned long get_budget() const { return _budget; }
+
+  bool empty() const { return _size == 0; }
+
+  // Tells whether a pending call is due for processing
+  bool ready() const {
+    const unsigned long now = millis();
+    for (const auto& call : _pending) {
+      if (call.used && long(now - call.due) >= 0)
+        return true;
+    }
+    return false;
+  }
+
+  /**
+   * Decides whether a call to the given function may be queued
+   * @param function_name The function to be called
+   * @param priority Set to the priority the call is scheduled with
+   * @return nullptr if the call was admitted, the reason otherwise
+   */
+  const char* admit(const char* function_name, uint8_t& priority) {
+    priority = 0;
+    if (_size - _replies == VRPC_MAX_PENDING_CALLS)
+      return "too many pending calls";
+    Policy* policy = get_policy(function_name, false);
+    if (policy != nullptr) {
+      priority = policy->priority;
+      if (policy->rate > 0) {
+        // milliseconds, as micros wraps within 72 minutes of idleness
+        const unsigned long now = millis();
+        policy->tokens += (now - policy->last_refill) * policy->rate / 1e3f;
+        if (policy->tokens > policy->burst)
+          policy->tokens = policy->burst;
+        policy->last_refill = now;
+        if (policy->tokens < 1)
+          return "rate limit exceeded";
+        policy->tokens -= 1;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Queues a call for later execution
+   * @param json The request, including context and function name
+   * @param priority The priority as determined by admit
+   * @param flags Combination of Flags kept with the call
+   * @param delay Milliseconds before the call is due
+   * @return false if the serialized request exceeds the reserved size, or if
+   * there is no slot left for a reply (flagged EXECUTED)
+   */
+  bool push(const Json& json,
+            uint8_t priority,
+            uint8_t flags = 0,
+            unsigned long delay = 0) {
+    const bool is_reply = flags & EXECUTED;
+    if (is_reply && _replies == _reply_slots)
+      return false;
+    if (measureJson(json) >= _request_size)
+      return false;
+    for (auto& call : _pending) {
+      if (!call.used && call.request != nullptr) {
+        serializeJson(json, call.request, _request_size);
+        call.sequence = _sequence++;
+        call.due = millis() + delay;
+        call.priority = priority;
+        call.flags = flags;
+        call.used = true;
+        ++_size;
+        if (is_reply)
+          ++_replies;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Removes the due call with the highest priority (oldest first)
+   * @param json Filled with the request of the call
+   * @param flags Set to the flags the call was pushed with
+   * @return false if no call was due
+   */
+  bool pop(Json& json, uint8_t& flags) {
+    const unsigned long now = millis();
+    PendingCall* next = nullptr;
+    for (auto& call : _pending) {
+      if (!call.used || long(now - call.due) < 0)
+        continue;
+      if (next == nullptr || call.priority > next->priority ||
+          (call.priority == next->priority &&
+           int32_t(call.sequence - next->sequence) < 0)) {
+        next = &call;
+      }
+    }
+    if (next == nullptr)
+      return false;
+    // parsing from a const buffer copies all strings into the document
+    deserializeJson(json, static_cast<const char*>(next->request));
+    flags = next->flags;
+    next->used = false;
+    --_size;
+    if (flags & EXECUTED)
+      --_replies;
+    return true;
+  }
+
+ private:
+  Policy* get_policy(const char* function_name, bool create) {
+    for (auto& policy : _policies) {
+      if (strcmp(policy.function_name, function_name) == 0)
+        return &policy;
+    }
+    if (!create)
+      return nullptr;
+    const FunctionEntry* entry = Registry::find("__global__", function_name);
+    if (entry == nullptr) {
+      Serial.print("ERROR [VRPC] Could not find function: ");
+      Serial.println(function_name);
+      return nullptr;
+    }
+    _policies.push_back(Policy());
+    _policies.back().function_name = entry->name;
+    return &_policies.back();
+  }
+};
+
+#ifdef VRPC_THREADED
+
+// Minimal threading shim, FreeRTOS on ESP32 and the standard library elsewhere
+namespace thread {
+
+#ifdef ARDUINO_ARCH_ESP32
+
+inline void start(void (*run)(void*), void* arg) {
+  xTaskCreatePinnedToCore(run, "vrpc", VRPC_WORKER_STACK_SIZE, arg, 1, nullptr,
+                          VRPC_WORKER_CORE);
+}
+
+// Must end the function passed to start
+inline void finish() {
+  vTaskDelete(nullptr);
+}
+
+// Wakes up a waiting thread, a notification is kept until consumed
+class Signal {
+  SemaphoreHandle_t _semaphore = xSemaphoreCreateBinary();
+
  public:
-  AbstractFunction() = default;
+  void notify() { xSemaphoreGive(_semaphore); }
+  void wait() { xSemaphoreTake(_semaphore, portMAX_DELAY); }
+};
 
-  virtual ~AbstractFunction() = default;
+#else
+
+inline void start(void (*run)(void*), void* arg) {
+  std::thread(run, arg).detach();
+}
+
+// Must end the function passed to start
+inline void finish() {}
+
+// Wakes up a waiting thread, a notification is kept until consumed
+class Signal {
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  bool _notified = false;
+
+ public:
+  void notify() {
+    // notifying under the lock lets the waiter destroy the signal right away
+    std::lock_guard<std::mutex> lock(_mutex);
+    _notified = true;
+    _condition.notify_one();
+  }
+  void wait() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait(lock, [this] { return _notified; });
+    _notified = false;
+  }
+};
+
+#endif
+
+}  // namespace thread
+
+/**
+ * Lock-free queue between exactly one producer and one consumer thread
+ */
+template <size_t N>
+class SpscRing {
+  std::atomic<size_t> _head{0};  // advanced by the consumer
+  std::atomic<size_t> _tail{0};  // advanced by the producer
+  uint8_t _items[N];
+
+ public:
+  bool push(uint8_t item) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == N)
+      return false;
+    _items[tail % N] = item;
+    // publishes the item and everything written before pushing it
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(uint8_t& item) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire))
+      return false;
+    item = _items[head % N];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+/**
+ * Executes calls on a separate thread. The thread calling the agent's loop
+ * parses a call into a preallocated slot and passes the slot on, the worker
+ * executes it in place and passes it back for serializing the reply.
+ */
+class Worker {
+  friend Worker& init<Worker>();
+
+ public:
+  struct Slot {
+    Arena arena;  // holds the JSON document, not shared with any thread
+    Json json;
+    uint8_t flags = 0;
+    bool busy = false;
+
+    Slot() : json(VRPC_JSON_CAPACITY, ArenaAllocator(&arena)) {}
+  };
+
+ private:
+  static_assert(VRPC_WORKER_SLOTS <= 255, "Too many worker slots");
+
+  Slot _slots[VRPC_WORKER_SLOTS];
+  SpscRing<VRPC_WORKER_SLOTS> _calls;    // to the worker
+  SpscRing<VRPC_WORKER_SLOTS> _results;  // from the worker
+  thread::Signal _signal;
+  thread::Signal _stopped;
+  std::atomic<bool> _stopping{false};
+  Arena _arena;  // temporaries of the worker thread
+  bool _started = false;
+
+ public:
+  ~Worker() {
+    // the thread must not outlive its state (only happens on exit of a host)
+    if (_started) {
+      _stopping = true;
+      _signal.notify();
+      _stopped.wait();
+    }
+  }
+
+  void start() {
+    if (_started)
+      return;
+    _started = true;
+    thread::start(&Worker::run, this);
+  }
+
+  // A free slot, or nullptr if all slots are busy
+  Slot* acquire() {
+    for (auto& slot : _slots) {
+      if (!slot.busy)
+        return &slot;
+    }
+    return nullptr;
+  }
+
+  void submit(Slot& slot, uint8_t flags) {
+    slot.flags = flags;
+    slot.busy = true;
+    _calls.push(&slot - _slots);
+    _signal.notify();
+  }
+
+  // An executed call, to be released once replied to
+  Slot* collect() {
+    uint8_t index;
+    return _results.pop(index) ? &_slots[index] : nullptr;
+  }
+
+  void release(Slot& slot) { slot.busy = false; }
+
+  bool idle() const {
+    for (const auto& slot : _slots) {
+      if (slot.busy)
+        return false;
+    }
+    return true;
+  }
+
+ private:
+  static void run(void* arg) {
+    Worker& worker = *static_cast<Worker*>(arg);
+    Arena::pointer() = &worker._arena;
+    while (!worker._stopping) {
+      worker._signal.wait();
+      uint8_t index;
+      while (worker._calls.pop(index)) {
+        Arena::Scope scope;
+        Registry::call(worker._slots[index].json);
+        worker._results.push(index);
+      }
+    }
+    worker._stopped.notify();
+    thread::finish();
+  }
+};
+
+#endif  // VRPC_THREADED
+
+/**
+ * Wraps the network client to count all bytes on the wire
+ */
+class CountingClient : public Client {
+  Client* _client = nullptr;
+
+ public:
+  uint32_t bytes_in = 0;
+  uint32_t bytes_out = 0;
+  uint32_t pings = 0;
+
+  void wrap(Client& client) { _client = &client; }
+
+  virtual int connect(IPAddress ip, uint16_t port) {
+    return _client->connect(ip, port);
+  }
+  virtual int connect(const char* host, uint16_t port) {
+    return _client->connect(host, port);
+  }
+#ifdef ARDUINO_ARCH_ESP32
+  virtual int connect(IPAddress ip, uint16_t port, int32_t timeout) {
+    return _client->connect(ip, port, timeout);
+  }
+  virtual int connect(const char* host, uint16_t port, int32_t timeout) {
+    return _client->connect(host, port, timeout);
+  }
+#endif
+  virtual size_t write(uint8_t b) {
+    const size_t n = _client->write(b);
+    bytes_out += n;
+    return n;
+  }
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    // PubSubClient writes a PINGREQ as a single two byte packet
+    if (size == 2 && buf[0] == 0xC0)
+      ++pings;
+    const size_t n = _client->write(buf, size);
+    bytes_out += n;
+    return n;
+  }
+  virtual int available() { return _client->available(); }
+  virtual int read() {
+    const int b = _client->read();
+    if (b >= 0)
+      ++bytes_in;
+    return b;
+  }
+  virtual int read(uint8_t* buf, size_t size) {
+    const int n = _client->read(buf, size);
+    if (n > 0)
+      bytes_in += n;
+    return n;
+  }
+  virtual int peek() { return _client->peek(); }
+  virtual void flush() { _client->flush(); }
+  virtual void stop() { _client->stop(); }
+  virtual uint8_t connected() { return _client->connected(); }
+  virtual operator bool() { return _client != nullptr && bool(*_client); }
+};
+
+/**
+ * Accounts the MQTT bytes per function and for protocol overhead and
+ * enforces an optional data budget
+ */
+class Traffic {
+  friend Traffic& init<Traffic>();
+
+ public:
+  enum Overhead { CONNECT, AGENT_INFO, CLASS_INFO, SUBSCRIBE, OVERHEAD_COUNT };
+
+  CountingClient client;
+  uint32_t overhead[OVERHEAD_COUNT] = {};
+  uint32_t budget = 0;  // 0 means unlimited
+  uint8_t actions = 0;
+  uint8_t min_priority = 0;
+  uint16_t keep_alive = 0;
+
+  // Size of a PUBLISH packet (QoS 0) on the wire
+  static size_t publish_size(size_t topic_length, size_t payload_length) {
+    return packet_size(2 + topic_length + payload_length);
+  }
+
+  // Size of a SUBSCRIBE packet plus its SUBACK on the wire
+  static size_t subscribe_size(size_t topic_length) {
+    return packet_size(2 + 2 + topic_length + 1) + 5;
+  }
+
+  // Size of a CONNECT packet plus its CONNACK on the wire
+  static size_t connect_size(const char* client_id,
+                             const char* will_topic,
+                             const char* will_message,
+                             const char* username,
+                             const char* password) {
+    size_t size = 10 + 2 + strlen(client_id) + 2 + strlen(will_topic) + 2 +
+                  strlen(will_message);
+    if (username != nullptr)
+      size += 2 + strlen(username);
+    if (password != nullptr)
+      size += 2 + strlen(password);
+    return packet_size(size) + 4;
+  }
 
-  void call_function(Json& j) { this->do_call_function(j); }
+  uint32_t total() const { return client.bytes_in + client.bytes_out; }
 
- protected:
-  virtual void do_call_function(Json&) = 0;
-};
+  bool restricts(uint8_t action) const {
+    return (actions & action) && budget != 0 && total() >= budget;
+  }
 
-template <typename R, typename... Args>
-class GlobalFunction : public AbstractFunction {
-  notstd::function<R(Args...)> _f;
+  void reset() {
+    client.bytes_in = client.bytes_out = client.pings = 0;
+    for (auto& bytes : overhead)
+      bytes = 0;
+    for (FunctionEntry* it = Registry::get_functions(); it; it = it->next)
+      it->bytes_in = it->bytes_out = 0;
+  }
 
- public:
-  template <typename F>
-  GlobalFunction(F&& f) : _f(f) {}
-  virtual ~GlobalFunction() = default;
+  void report(JsonObject usage) const {
+    usage["in"] = client.bytes_in;
+    usage["out"] = client.bytes_out;
+    usage["budget"] = budget;
+    usage["exceeded"] = budget != 0 && total() >= budget;
+    uint32_t attributed = 0;
+    JsonObject functions = usage.createNestedObject("functions");
+    for (const FunctionEntry* it = Registry::get_functions(); it;
+         it = it->next) {
+      // bytes of overloads are counted with the first one declared
+      if (Registry::find(it->context, it->name) != it)
+        continue;
+      JsonObject function = functions.createNestedObject(it->name);
+      function["in"] = it->bytes_in;
+      function["out"] = it->bytes_out;
+      attributed += it->bytes_in + it->bytes_out;
+    }
+    // a keepalive is a PINGREQ and a PINGRESP of two bytes each
+    const uint32_t keep_alive_bytes = client.pings * 4;
+    JsonObject protocol = usage.createNestedObject("protocol");
+    protocol["connect"] = overhead[CONNECT];
+    protocol["agentInfo"] = overhead[AGENT_INFO];
+    protocol["classInfo"] = overhead[CLASS_INFO];
+    protocol["subscribe"] = overhead[SUBSCRIBE];
+    protocol["keepalive"] = keep_alive_bytes;
+    for (auto bytes : overhead)
+      attributed += bytes;
+    attributed += keep_alive_bytes;
+    // acknowledgements, failed calls, etc.
+    protocol["other"] = total() > attributed ? total() - attributed : 0;
+  }
 
-  virtual void do_call_function(Json& j) {
-    j["r"] = call<R>(_f, unpack<Args...>(j));
+ private:
+  static size_t packet_size(size_t remaining_length) {
+    return 1 + (remaining_length < 128 ? 1 : remaining_length < 16384 ? 2 : 3) +
+           remaining_length;
   }
 };
 
-template <typename... Args>
-class GlobalFunction<void, Args...> : public AbstractFunction {
-  notstd::function<void(Args...)> _f;
+/**
+ * Settings for calls received on the domain-wide broadcast topics
+ */
+struct Broadcast {
+  bool enabled = false;
+  bool reply = false;
+  unsigned long max_jitter = 0;  // milliseconds
+  const char* agent = "";        // identifies this agent in replies
+};
+
+/**
+ * State of the MQTT session, persistent in sleep mode
+ */
+struct Session {
+  bool persistent = false;  // connect with clean session off
+  bool established = false;  // subscriptions are kept by the broker
+  bool announced = false;    // the retained agent info reads online
+  bool online = false;       // connected when last checked
+  bool sleeping = false;     // disconnected cleanly by sleep
+  bool waking = false;       // connect was called since sleep
+  unsigned long awake_since = 0;
+  unsigned long last_activity = 0;
+};
 
+/**
+ * Fixed-memory history of a periodically sampled value. Samples are
+ * quantized to a resolution and stored as zigzag varint deltas in a byte
+ * ring, such that slowly changing values need a single byte per sample.
+ * Timestamps are implicit (fixed period), missed or failed (NaN) samples are
+ * stored as gaps and the oldest samples are dropped once the ring is full.
+ */
+class TimeSeries {
  public:
-  template <typename F>
-  GlobalFunction(F&& f) : _f(f) {}
-  virtual ~GlobalFunction() = default;
+  typedef float (*Getter)();
 
-  virtual void do_call_function(Json& j) {
-    call<void>(_f, unpack<Args...>(j));
-    j["r"] = nullptr;
+ private:
+  // Aggregate of the (quantized) samples falling into a query bucket
+  struct Bucket {
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+    uint32_t count;
+  };
+
+  // Keeps every delta below 2^31 after zigzag encoding and tagging
+  static const int32_t MAX_VALUE = 1L << 28;
+
+  const char* _name;
+  Getter _getter;
+  unsigned long _period;  // milliseconds
+  float _resolution;
+  uint8_t* _data;
+  size_t _capacity;
+  size_t _head = 0;  // position of the oldest token
+  size_t _used = 0;
+  size_t _count = 0;  // periods covered, from the oldest to the newest sample
+  size_t _skipped = 0;  // failed samples not yet stored as gap
+  int32_t _head_value = 0;
+  int32_t _tail_value = 0;
+  unsigned long _due = 0;
+  unsigned long _last_sample = 0;
+  bool _started = false;  // the sampling grid starts with the first sample
+  TimeSeries* _next = nullptr;
+
+ public:
+  TimeSeries(const char* name,
+             Getter getter,
+             unsigned long period,
+             float resolution,
+             uint8_t* data,
+             size_t capacity)
+      : _name(name),
+        _getter(getter),
+        _period(period > 0 ? period : 1),
+        _resolution(resolution > 0 ? resolution : 1),
+        _data(data),
+        _capacity(capacity) {
+    // appending keeps the order of declaration
+    TimeSeries** it = &init<TimeSeries*>();
+    while (*it != nullptr)
+      it = &(*it)->_next;
+    *it = this;
   }
-};
 
-class Registry {
-  friend Registry& init<Registry>();
-  typedef std::map<String, AbstractFunction*> StringFunctionMap;
-  typedef std::map<String, StringFunctionMap> FunctionRegistry;
+  static TimeSeries* get_series() { return init<TimeSeries*>(); }
 
-  FunctionRegistry _function_registry;
+  static TimeSeries* find(const char* name) {
+    for (TimeSeries* it = init<TimeSeries*>(); it; it = it->_next) {
+      if (strcmp(it->_name, name) == 0)
+        return it;
+    }
+    return nullptr;
+  }
 
- public:
-  template <typename Func, Func f, typename R, typename... Args>
-  static void register_global_function(const String& function_name) {
-    AbstractFunction* func = new GlobalFunction<R, Args...>(f);
-    init<Registry>()._function_registry["__global__"][function_name] = func;
+  // Samples every time series that is due
+  static void sample_all() {
+    for (TimeSeries* it = init<TimeSeries*>(); it; it = it->_next)
+      it->sample();
   }
 
-  static String call(const String& jsonString) {
-    Json json(256);
-    DeserializationError err = deserializeJson(json, jsonString);
-    if (err) {
-      Serial.print(F("ERROR [VRPC] JSON parsing failed because: "));
-      Serial.println(err.c_str());
-      return String("{\"e\": \"JSON parsing failed because: ") +
-             String(err.c_str()) + String("\"}");
+  TimeSeries* next() const { return _next; }
+
+  void sample() {
+    const unsigned long now = millis();
+    size_t missed = 0;
+    if (!_started) {
+      _due = now;
+      _started = true;
+    } else if (long(now - _due) < 0) {
+      return;
+    } else {
+      // late samples stay on the grid, whole periods missed become a gap
+      missed = (now - _due) / _period;
     }
-    Registry::call(json);
-    String res;
-    serializeJson(json, res);
-    return res;
+    const unsigned long time = _due + missed * _period;
+    _due = time + _period;
+    const float value = _getter();
+    if (isnan(value)) {
+      if (_count != 0)
+        _skipped += missed + 1;
+      return;
+    }
+    const float scaled = value / _resolution;
+    int32_t q = MAX_VALUE;
+    if (scaled < MAX_VALUE)
+      q = scaled > -MAX_VALUE ? int32_t(lround(scaled)) : -MAX_VALUE;
+    store(_skipped + missed, q);
+    _skipped = 0;
+    _last_sample = time;
   }
 
-  static void call(Json& json) {
-    String context = json["c"].as<String>();
-    String function_name = json["f"].as<String>();
-    // TODO implement support for overloading
-    // JsonVariant args = json["data"];
-    // function_name += vrpc::get_signature(args);
-    auto it_t = init<Registry>()._function_registry.find(context);
-    if (it_t != init<Registry>()._function_registry.end()) {
-      auto it_f = it_t->second.find(function_name);
-      if (it_f != it_t->second.end()) {
-        it_f->second->call_function(json);
+  /**
+   * Downsamples the stored samples into buckets of equal duration
+   * @param result Filled with the bucket interval and the min, max and avg
+   * arrays (null for empty buckets)
+   * @param from Start of the range in milliseconds ago, 0 covers all samples
+   * @param to End of the range in milliseconds ago
+   * @param buckets Number of buckets
+   * @return false if not enough memory was available
+   */
+  bool query(JsonObject result,
+             unsigned long from,
+             unsigned long to,
+             size_t buckets) const {
+    const unsigned long newest_age = millis() - _last_sample;
+    if (from == 0)
+      from = newest_age + span() + 1;
+    if (from <= to)
+      from = to + 1;
+    const unsigned long interval = (from - to + buckets - 1) / buckets;
+    Bucket* aggregates = static_cast<Bucket*>(
+        Arena::current().allocate(buckets * sizeof(Bucket)));
+    if (aggregates == nullptr)
+      return false;
+    for (size_t i = 0; i < buckets; ++i)
+      aggregates[i] = Bucket{0, 0, 0, 0};
+    // walks from the oldest to the newest sample
+    size_t position = _head;
+    size_t remaining = _used;
+    size_t slot = 0;
+    int32_t value = _head_value;
+    bool is_sample = _count != 0;
+    while (true) {
+      const unsigned long age = newest_age + (_count - 1 - slot) * _period;
+      if (is_sample && age >= to && age < from) {
+        size_t index = (from - 1 - age) / interval;
+        Bucket& bucket = aggregates[index < buckets ? index : buckets - 1];
+        if (bucket.count == 0 || value < bucket.min)
+          bucket.min = value;
+        if (bucket.count == 0 || value > bucket.max)
+          bucket.max = value;
+        bucket.sum += value;
+        ++bucket.count;
+      }
+      if (remaining == 0)
+        break;
+      const uint32_t token = read(position, remaining);
+      is_sample = !(token & 1);
+      if (is_sample) {
+        value += unzigzag(token >> 1);
+        ++slot;
       } else {
-        Serial.print("ERROR [VRPC] Could not find function: ");
-        Serial.println(function_name);
-        json["e"] = "Could not find function: " + function_name;
+        slot += token >> 1;
       }
-    } else {
-      Serial.print("ERROR [VRPC] Could not find context: ");
-      Serial.println(context);
-      json["e"] = "Could not find context: " + context;
     }
+    result["interval"] = interval;
+    JsonArray min = result.createNestedArray("min");
+    JsonArray max = result.createNestedArray("max");
+    JsonArray avg = result.createNestedArray("avg");
+    for (size_t i = 0; i < buckets; ++i) {
+      const Bucket& bucket = aggregates[i];
+      if (bucket.count == 0) {
+        min.add(nullptr);
+        max.add(nullptr);
+        avg.add(nullptr);
+        continue;
+      }
+      min.add(bucket.min * _resolution);
+      max.add(bucket.max * _resolution);
+      avg.add(float(bucket.sum) / bucket.count * _resolution);
+    }
+    return true;
+  }
+
+  void describe(JsonObject info) const {
+    info["name"] = _name;
+    info["period"] = _period;
+    info["resolution"] = _resolution;
+    info["span"] = span();
+    info["bytes"] = _used;
+    info["capacity"] = _capacity;
   }
 
-  static std::vector<String> get_classes() {
-    std::vector<String> classes;
-    for (const auto& kv : init<Registry>()._function_registry) {
-      classes.push_back(kv.first);
+  // Milliseconds between the oldest and the newest sample
+  unsigned long span() const {
+    return _count > 1 ? (_count - 1) * _period : 0;
+  }
+
+ private:
+  void store(size_t gap, int32_t value) {
+    if (_count == 0) {
+      _head_value = _tail_value = value;
+      _count = 1;
+      return;
     }
-    return classes;
+    // a gap token (tagged 1) precedes the delta token (tagged 0)
+    if (gap > MAX_VALUE)
+      gap = MAX_VALUE;
+    const uint32_t gap_token = (uint32_t(gap) << 1) | 1;
+    const uint32_t delta_token = zigzag(value - _tail_value) << 1;
+    const size_t needed =
+        (gap > 0 ? varint_size(gap_token) : 0) + varint_size(delta_token);
+    while (_capacity - _used < needed)
+      drop_oldest();
+    if (gap > 0)
+      write(gap_token);
+    write(delta_token);
+    _count += gap + 1;
+    _tail_value = value;
   }
 
-  static std::vector<String> get_static_functions(const String& class_name) {
-    std::vector<String> functions;
-    const auto& it = init<Registry>()._function_registry.find(class_name);
-    if (it != init<Registry>()._function_registry.end()) {
-      for (const auto& kv : it->second) {
-        functions.push_back(kv.first);
+  void drop_oldest() {
+    // removes the oldest sample and a gap following it, the next sample
+    // becomes the oldest one
+    --_count;
+    while (_used > 0) {
+      const uint32_t token = read(_head, _used);
+      if (token & 1) {
+        _count -= token >> 1;
+      } else {
+        _head_value += unzigzag(token >> 1);
+        break;
       }
     }
-    return functions;
+  }
+
+  void write(uint32_t token) {
+    do {
+      const uint8_t byte = token & 0x7F;
+      token >>= 7;
+      _data[(_head + _used++) % _capacity] = token ? byte | 0x80 : byte;
+    } while (token);
+  }
+
+  uint32_t read(size_t& position, size_t& remaining) const {
+    uint32_t token = 0;
+    for (uint8_t shift = 0; remaining > 0; shift += 7) {
+      const uint8_t byte = _data[position];
+      position = (position + 1) % _capacity;
+      --remaining;
+      token |= uint32_t(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    return token;
+  }
+
+  static size_t varint_size(uint32_t token) {
+    size_t size = 1;
+    while (token >>= 7)
+      ++size;
+    return size;
+  }
+
+  static uint32_t zigzag(int32_t value) {
+    return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+  }
+
+  static int32_t unzigzag(uint32_t value) {
+    return int32_t(value >> 1) ^ -int32_t(value & 1);
   }
 };
 
-template <typename Func, Func f, typename R, typename... Args>
-struct GlobalFunctionRegistrar {
-  GlobalFunctionRegistrar(const String& function_name) {
-    Registry::register_global_function<Func, f, R, Args...>(function_name);
+/**
+ * Provides the ring memory of a time series, statically allocated together
+ * with it
+ */
+template <size_t N>
+struct TimeSeriesBuffer : TimeSeries {
+  static_assert(N >= 16, "A time series needs at least 16 bytes");
+
+  uint8_t data[N];
+
+  TimeSeriesBuffer(const char* name,
+                   Getter getter,
+                   unsigned long period,
+                   float resolution)
+      : TimeSeries(name, getter, period, resolution, data, N) {}
+};
+
+/**
+ * Registers a function on construction, the entry lives as long as the
+ * (statically allocated) registrar
+ */
+struct FunctionRegistrar {
+  mutable FunctionEntry entry;
+
+  FunctionRegistrar(const char* context,
+                    const char* function_name,
+                    Thunk thunk,
+                    uint32_t signature)
+      : entry{context, function_name, thunk, signature, nullptr, 0, 0} {
+    Registry::register_function(entry);
   }
 };
 
+template <typename Func, Func f, typename R, typename... Args>
+struct GlobalFunctionRegistrar : FunctionRegistrar {
+  /**
+   * @param function_name The name the function is called by
+   * @param function_hash function_hash("__global__", function_name),
+   * computed at compile time
+   */
+  GlobalFunctionRegistrar(const char* function_name, uint32_t function_hash)
+      : FunctionRegistrar("__global__",
+                          function_name,
+                          &GlobalFunction<Func, f, R, Args...>::invoke,
+                          Signature<Args...>::hash(function_hash)) {}
+};
+
 template <typename Func, Func f, typename R, typename... Args>
 struct RegisterGlobalFunction {
   static const GlobalFunctionRegistrar<Func, f, R, Args...> registerAs;
 };
 
+// Functions provided by the agent itself
+namespace builtins {
+
+inline void get_data_usage(Json& j) {
+  init<Traffic>().report(j["r"].to<JsonObject>());
+}
+
+inline void reset_data_usage(Json& j) {
+  init<Traffic>().reset();
+  j["r"] = nullptr;
+}
+
+inline void get_time_series(Json& j) {
+  const char* name = j["a"][0] | "";
+  const unsigned long from = j["a"][1] | 0ul;
+  const unsigned long to = j["a"][2] | 0ul;
+  size_t buckets = j["a"][3] | 0u;
+  if (buckets == 0 || buckets > VRPC_TIME_SERIES_MAX_BUCKETS)
+    buckets = VRPC_TIME_SERIES_MAX_BUCKETS;
+  const TimeSeries* series = TimeSeries::find(name);
+  if (series == nullptr) {
+    j["e"] = Arena::current().concat("Could not find time series: ", name);
+  } else if (from != 0 && from <= to) {
+    j["e"] = "Invalid time range";
+  } else if (!series->query(j["r"].to<JsonObject>(), from, to, buckets)) {
+    j.remove("r");
+    j["e"] = "Not enough memory for the query";
+  }
+}
+
+inline void list_time_series(Json& j) {
+  JsonArray list = j["r"].to<JsonArray>();
+  for (const TimeSeries* it = TimeSeries::get_series(); it; it = it->next())
+    it->describe(list.createNestedObject());
+}
+
+const FunctionRegistrar getDataUsage(
+    "VrpcAgent",
+    "getDataUsage",
+    &get_data_usage,
+    function_hash("VrpcAgent", "getDataUsage"));
+const FunctionRegistrar resetDataUsage(
+    "VrpcAgent",
+    "resetDataUsage",
+    &reset_data_usage,
+    function_hash("VrpcAgent", "resetDataUsage"));
+const FunctionRegistrar getTimeSeries(
+    "VrpcAgent",
+    "getTimeSeries",
+    &get_time_series,
+    Signature<String, unsigned long, unsigned long, uint8_t>::hash(
+        function_hash("VrpcAgent", "getTimeSeries")));
+const FunctionRegistrar listTimeSeries(
+    "VrpcAgent",
+    "listTimeSeries",
+    &list_time_series,
+    function_hash("VrpcAgent", "listTimeSeries"));
+
+}  // namespace builtins
+
 }  // namespace vrpc
 
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
@@ -254,13 +1631,44 @@ struct RegisterGlobalFunction {
  *
  */
 class VrpcAgent {
+  struct ClassInfo {
+    const char* name;
+    const char* topic;
+    const char* subscription;  // covers all static functions of the class
+    uint32_t hash;
+    uint32_t published_hash;
+  };
+
+  String _domain;
+  String _groups;
   String _domain_agent;
   String _token;
   String _username;
   String _broker;
   long _lastReconnect = 0;
+  uint16_t _keep_alive = 15;
+  char _buffer[VRPC_CONNECT_BUFFER_SIZE];
+  size_t _buffer_size = 0;
+  const char* _client_id = "";
+  const char* _info_topic = "";
+  const char* _broadcast_topics = "";  // consecutive null-terminated topics
+  size_t _broadcast_topic_count = 0;
+  ClassInfo _class_infos[VRPC_MAX_CLASSES];
+  size_t _class_count = 0;
 
  public:
+  /**
+   * @brief Actions taken once the data budget is exceeded
+   */
+  enum BudgetAction : uint8_t {
+    /// Calls to functions below a minimum priority are refused
+    REFUSE_CALLS = 1,
+    /// Failed or refused calls are not replied to
+    SILENT_ERRORS = 2,
+    /// Reconnects use a longer keepalive interval
+    LONG_KEEPALIVE = 4
+  };
+
   /**
    * @brief Constructs an agent
    *
@@ -269,11 +1677,15 @@ class VrpcAgent {
    */
   VrpcAgent(int maxBytesPerMessage = 1024) {
     vrpc::client.setBufferSize(maxBytesPerMessage);
+    vrpc::init<vrpc::Scheduler>().reserve(maxBytesPerMessage);
   }
 
   /**
    * @brief Initializes the object using a client class for network transport
    *
+   * With `VRPC_THREADED` defined, this also starts the worker thread executing
+   * all calls, while the thread calling `loop` keeps the transport.
+   *
    * @tparam T Type of the client class
    * @param netClient A client class following the interface as described
    * [here](https://www.arduino.cc/en/Reference/ClientConstructor)
@@ -284,21 +1696,37 @@ class VrpcAgent {
    * @param broker [optional, default: `"vrpc.io"`] Address of the MQTT broker
    * @param username [optional] MQTT username (not needed when using the vrpc.io
    * broker)
+   * @param groups [optional] Comma-separated group tags, the agent
+   * additionally receives broadcasts to these groups (see `enable_broadcast`)
    */
   template <typename T>
   void begin(T& netClient,
              const String& domain = "vrpc",
              const String& token = "",
              const String& broker = "vrpc.io",
-             const String& username = "") {
+             const String& username = "",
+             const String& groups = "") {
+    _domain = domain;
+    _groups = groups;
     _domain_agent = domain + "/" + VrpcAgent::get_unique_id();
     _token = token == "" ? VrpcAgent::get_id_from_compile_date() : token;
     _username = username == "" ? _domain_agent : username;
     _broker = broker;
-    vrpc::client.setClient(netClient);
+    vrpc::Traffic& traffic = vrpc::init<vrpc::Traffic>();
+    traffic.client.wrap(netClient);
+    vrpc::client.setClient(traffic.client);
     vrpc::client.setServer(_broker.c_str(), 1883);
-    vrpc::client.setKeepAlive(15);
+    vrpc::client.setKeepAlive(_keep_alive);
     vrpc::client.setCallback(on_message);
+    prepare_connect_buffer();
+    if (vrpc::Registry::overflows()) {
+      Serial.println(
+          "ERROR [VRPC] Function table full, increase "
+          "VRPC_FUNCTION_TABLE_SIZE");
+    }
+#ifdef VRPC_THREADED
+    vrpc::init<vrpc::Worker>().start();
+#endif
   }
 
   /**
@@ -315,23 +1743,40 @@ class VrpcAgent {
    * to see the connectivity progress.
    */
   bool connect() {
+    VrpcAgent::detect_connection_loss();
+    vrpc::Session& session = vrpc::init<vrpc::Session>();
+    // the awake phase starts with the first attempt to wake up
+    if (session.sleeping && !session.waking) {
+      session.waking = true;
+      session.awake_since = millis();
+    }
     Serial.println("\nConnecting to message broker...");
     Serial.print("domain/agent: ");
     Serial.println(_domain_agent);
     Serial.print("broker: ");
     Serial.println(_broker);
-    String clientId = "va3" + VrpcAgent::get_unique_id();
-    String willTopic(_domain_agent + "/__agentInfo__");
-    String willMessage = this->create_agent_info_payload(false);
     Serial.print("clientId: ");
-    Serial.println(clientId);
+    Serial.println(_client_id);
+    const char* willMessage = VrpcAgent::create_agent_info_payload(false);
+    vrpc::Traffic& traffic = vrpc::init<vrpc::Traffic>();
+    vrpc::client.setKeepAlive(traffic.restricts(LONG_KEEPALIVE)
+                                  ? traffic.keep_alive
+                                  : _keep_alive);
+    const bool cleanSession = !session.persistent;
     bool connected = false;
     if (_token == "" && _username == "") {
-      connected = vrpc::client.connect(clientId.c_str(), willTopic.c_str(), 1, true,
-                      willMessage.c_str());
+      connected =
+          vrpc::client.connect(_client_id, nullptr, nullptr, _info_topic, 1,
+                               true, willMessage, cleanSession);
+      traffic.overhead[vrpc::Traffic::CONNECT] += vrpc::Traffic::connect_size(
+          _client_id, _info_topic, willMessage, nullptr, nullptr);
     } else {
-      connected = vrpc::client.connect(clientId.c_str(), _username.c_str(), _token.c_str(),
-                      willTopic.c_str(), 1, true, willMessage.c_str());
+      connected = vrpc::client.connect(
+          _client_id, _username.c_str(), _token.c_str(), _info_topic, 1, true,
+          willMessage, cleanSession);
+      traffic.overhead[vrpc::Traffic::CONNECT] += vrpc::Traffic::connect_size(
+          _client_id, _info_topic, willMessage, _username.c_str(),
+          _token.c_str());
     }
     // finish here if we could not connect
     if (!connected) {
@@ -339,26 +1784,248 @@ class VrpcAgent {
     }
     // otherwise provide info messages
     Serial.println("[OK]");
-    publish_agent_info();
-    const auto& classes = vrpc::Registry::get_classes();
-    for (const auto& class_name : classes) {
-      publish_class_info(class_name);
-      const auto& functions = vrpc::Registry::get_static_functions(class_name);
-      for (const auto& func : functions) {
-        String topic(_domain_agent + "/" + class_name + "/__static__/" + func);
-        vrpc::client.subscribe(topic.c_str());
+    session.online = true;
+    session.sleeping = session.waking = false;
+    session.last_activity = millis();
+    // a resumed session still has its subscriptions and, after a clean
+    // sleep, the online agent info and the retained class infos (even if a
+    // deep sleep cleared our memory), calls queued meanwhile arrive right away
+    const bool resumed = session.persistent && session.announced;
+    if (!resumed) {
+      publish_agent_info();
+    }
+    for (size_t i = 0; i < _class_count; ++i) {
+      ClassInfo& info = _class_infos[i];
+      if (resumed) {
+        info.published_hash = info.hash;
+      }
+      // the registry is fixed at runtime, so retained class infos only need
+      // to be published again if the content (or topic) changed
+      if (info.hash != info.published_hash) {
+        vrpc::Arena::Scope scope;
+        publish_class_info(info, VrpcAgent::render_class_info(info.name));
       }
     }
+    if (!(session.persistent && session.established)) {
+      bool subscribed = true;
+      for (size_t i = 0; i < _class_count; ++i) {
+        subscribed = subscribe(_class_infos[i].subscription) && subscribed;
+      }
+      const char* topic = _broadcast_topics;
+      for (size_t i = 0; i < _broadcast_topic_count; ++i) {
+        subscribed = subscribe(topic) && subscribed;
+        topic += strlen(topic) + 1;
+      }
+      // PubSubClient reports neither the SUBACK codes nor the session present
+      // flag, a failed subscription is retried with the next connect
+      session.established = session.persistent && subscribed;
+    }
+    session.announced = true;
     return vrpc::client.connected();
   }
 
+  /**
+   * @brief Sets the MQTT keepalive interval
+   *
+   * Takes effect with the next connect.
+   *
+   * @param seconds [default: `15`] Keepalive interval in seconds
+   */
+  void set_keep_alive(uint16_t seconds) { _keep_alive = seconds; }
+
+  /**
+   * @brief Enables the duty-cycled mode for battery powered boards
+   *
+   * The agent connects with a persistent session (clean session off, stable
+   * client id) and subscribes with QoS 1, such that the broker queues calls
+   * while the board sleeps. Waking up, `connect` skips re-announcement and
+   * re-subscription and the queued calls are delivered right away. After an
+   * unexpected connection loss the agent announces and subscribes again. Use
+   * `ready_to_sleep` and `sleep` to end the awake phase.
+   *
+   * @param sessionEstablished [optional, default: `false`] Pass `true` if
+   * `session_established` reported `true` before a deep sleep (e.g. kept in
+   * RTC memory), such that even the first connect resumes the session
+   */
+  void enable_sleep_mode(bool sessionEstablished = false) {
+    vrpc::Session& session = vrpc::init<vrpc::Session>();
+    session.persistent = true;
+    session.established = session.announced = sessionEstablished;
+  }
+
+  /**
+   * @brief Reports whether the broker keeps a session for this agent
+   *
+   * @return true once all subscriptions of the persistent session were sent
+   */
+  bool session_established() {
+    return vrpc::init<vrpc::Session>().established;
+  }
+
+  /**
+   * @brief Tells whether all queued calls were processed
+   *
+   * @param quietTime [optional, default: `200`] Milliseconds without any
+   * incoming message after which the broker is considered drained
+   * @return true if it is safe to call `sleep`
+   */
+  bool ready_to_sleep(unsigned long quietTime = 200) {
+    const vrpc::Session& session = vrpc::init<vrpc::Session>();
+    return vrpc::client.connected() &&
+           vrpc::init<vrpc::Scheduler>().empty() &&
+#ifdef VRPC_THREADED
+           vrpc::init<vrpc::Worker>().idle() &&
+#endif
+           millis() - session.last_activity >= quietTime;
+  }
+
+  /**
+   * @brief Ends the awake phase by cleanly disconnecting from the broker
+   *
+   * The broker keeps the session and queues calls until the next `connect`.
+   *
+   * @return Milliseconds the agent was awake in this cycle
+   */
+  unsigned long sleep() {
+    vrpc::Session& session = vrpc::init<vrpc::Session>();
+    vrpc::client.disconnect();
+    session.online = false;
+    session.sleeping = true;
+    const unsigned long awake = millis() - session.awake_since;
+    Serial.print("Going to sleep, was awake for [ms]: ");
+    Serial.println(awake);
+    return awake;
+  }
+
+  /**
+   * @brief Lets the agent execute calls broadcast to the whole domain
+   *
+   * Broadcasts are published to `<domain>/__all__/<class>/__static__/<func>`
+   * and reach every agent of the domain, or to
+   * `<domain>/__all__.<group>/<class>/__static__/<func>` to reach only the
+   * agents tagged with that group in `begin`. Functions not provided by this
+   * agent are silently ignored.
+   *
+   * @param reply [optional, default: `false`] Whether to reply to broadcast
+   * calls. Replies carry the agent (`"agent"`) for aggregation.
+   * @param maxJitter [optional, default: `2000`] Replies are delayed by a
+   * pseudo-random amount of milliseconds up to this value, which differs
+   * between agents, to spread the load. A delayed reply waits in an extra
+   * pending call buffer (`maxBytesPerMessage` bytes), another reply to a
+   * broadcast arriving meanwhile is sent right away
+   */
+  void enable_broadcast(bool reply = false, unsigned long maxJitter = 2000) {
+    vrpc::Broadcast& broadcast = vrpc::init<vrpc::Broadcast>();
+    broadcast.enabled = true;
+    broadcast.reply = reply;
+    broadcast.max_jitter = maxJitter;
+    vrpc::Scheduler& scheduler = vrpc::init<vrpc::Scheduler>();
+    scheduler.reserve(scheduler.get_request_size(), reply && maxJitter > 0);
+    if (_domain_agent != "") {
+      prepare_connect_buffer();
+    }
+  }
+
+  /**
+   * @brief Enforces a budget on the bytes sent and received
+   *
+   * All MQTT bytes on the wire are counted, per function and for protocol
+   * overhead. The numbers are remotely available through the built-in
+   * functions `VrpcAgent.getDataUsage` and `VrpcAgent.resetDataUsage`.
+   * Built-in functions are neither refused nor silenced, such that an
+   * exceeded budget can be reset remotely.
+   *
+   * @param bytes Budget in bytes (in and out), `0` (default) is unlimited
+   * @param actions [optional, default: all] Bitwise combination of
+   * `BudgetAction`s taken once the budget is exceeded
+   * @param minPriority [optional, default: `1`] Minimum priority a function
+   * needs to be called with `REFUSE_CALLS`
+   * @param keepAlive [optional, default: `300`] Keepalive interval (seconds)
+   * used with `LONG_KEEPALIVE`
+   */
+  void set_data_budget(uint32_t bytes,
+                       uint8_t actions = REFUSE_CALLS | SILENT_ERRORS |
+                                         LONG_KEEPALIVE,
+                       uint8_t minPriority = 1,
+                       uint16_t keepAlive = 300) {
+    vrpc::Traffic& traffic = vrpc::init<vrpc::Traffic>();
+    traffic.budget = bytes;
+    traffic.actions = actions;
+    traffic.min_priority = minPriority;
+    traffic.keep_alive = keepAlive;
+  }
+
+  /**
+   * @brief Reports the number of bytes sent and received
+   *
+   * @return Bytes counted since start or the last reset
+   */
+  uint32_t get_data_usage() { return vrpc::init<vrpc::Traffic>().total(); }
+
+  /**
+   * @brief Resets all byte counters, e.g. at the start of a billing period
+   */
+  void reset_data_usage() { vrpc::init<vrpc::Traffic>().reset(); }
+
+  /**
+   * @brief Limits the rate at which a function may be called
+   *
+   * Calls exceeding the limit are immediately answered with a "busy" error
+   * instead of being executed.
+   *
+   * @param functionName Name of the (global) function
+   * @param callsPerSecond Sustained number of calls per second, `0` removes
+   * the limit
+   * @param burst [optional, default: `1`] Number of calls that may arrive at
+   * once
+   */
+  void set_rate_limit(const String& functionName,
+                      float callsPerSecond,
+                      uint8_t burst = 1) {
+    vrpc::init<vrpc::Scheduler>().set_rate_limit(functionName, callsPerSecond,
+                                                 burst);
+  }
+
+  /**
+   * @brief Sets the priority of a function
+   *
+   * Pending calls with higher priority are executed first.
+   *
+   * @param functionName Name of the (global) function
+   * @param priority [default for all functions: `0`] The priority
+   */
+  void set_priority(const String& functionName, uint8_t priority) {
+    vrpc::init<vrpc::Scheduler>().set_priority(functionName, priority);
+  }
+
+  /**
+   * @brief Limits the time spent executing calls per `loop` iteration
+   *
+   * At least one pending call is executed per iteration, the remaining ones
+   * are deferred to the next iteration once the budget is used up.
+   *
+   * @param microseconds Time budget, `0` (default) executes all pending calls
+   */
+  void set_loop_budget(unsigned long microseconds) {
+    vrpc::init<vrpc::Scheduler>().set_budget(microseconds);
+  }
+
   /**
    * @brief This function will send and receive VRPC packets
    *
+   * Also samples the time series that are due, whether connected or not.
+   *
    * **IMPORTANT**: This function should be called in every `loop`
    */
   void loop() {
+    vrpc::TimeSeries::sample_all();
     if (!vrpc::client.connected()) {
+      VrpcAgent::detect_connection_loss();
+      const vrpc::Session& session = vrpc::init<vrpc::Session>();
+      // a sleeping agent reconnects by an explicit call to connect
+      if (session.sleeping && !session.waking) {
+        return;
+      }
       long now = millis();
       if (now - _lastReconnect > 5000) {
         _lastReconnect = now;
@@ -370,10 +2037,22 @@ class VrpcAgent {
       }
     } else {
       vrpc::client.loop();
+      process_pending_calls();
     }
   }
 
  private:
+  static void detect_connection_loss() {
+    vrpc::Session& session = vrpc::init<vrpc::Session>();
+    if (session.online && !vrpc::client.connected()) {
+      // an established connection was lost, the will was published and the
+      // session may be gone
+      session.online = false;
+      session.announced = false;
+      session.established = false;
+    }
+  }
+
   String get_state() {
     switch (vrpc::client.state()) {
       case -4:
@@ -406,29 +2085,149 @@ class VrpcAgent {
   }
 
   static void on_message(char* topic, byte* payload, unsigned int size) {
-    String topicString(topic);
-    std::vector<String> tokens = VrpcAgent::tokenize(topicString, '/');
-    if (tokens.size() != 5) {
+    vrpc::init<vrpc::Session>().last_activity = millis();
+    vrpc::Arena::Scope scope;
+    vrpc::Arena& arena = vrpc::Arena::current();
+    char* tokens[5];
+    const size_t topic_length = strlen(topic);
+    char* topicCopy = arena.copy(topic);
+    if (topicCopy == nullptr ||
+        VrpcAgent::tokenize(topicCopy, '/', tokens, 5) != 5) {
       Serial.println("ERROR [VRPC] Received invalid message");
       return;
     }
-    String class_name(tokens[2]);
-    String instance(tokens[3]);
-    String method(tokens[4]);
-    vrpc::Json j(1024);
+    const char* class_name = tokens[2];
+    const char* instance = tokens[3];
+    const char* method = tokens[4];
+    const char* context =
+        strcmp(instance, "__static__") == 0 ? class_name : instance;
+    const bool is_broadcast = strncmp(tokens[1], "__all__", 7) == 0;
+    vrpc::FunctionEntry* entry = vrpc::Registry::find(context, method);
+    if (entry != nullptr) {
+      entry->bytes_in += vrpc::Traffic::publish_size(topic_length, size);
+    } else if (is_broadcast) {
+      // broadcasts target agents with different functions
+      return;
+    }
+    vrpc::Json j(VRPC_JSON_CAPACITY);
     deserializeJson(j, payload, size);
-    j["c"] = instance == "__static__" ? class_name : instance;
+    j["c"] = context;
     j["f"] = method;
-    const String sender = j["s"];
-    Serial.print("Going to call: ");
-    Serial.println(method);
-    vrpc::Registry::call(j);
+    vrpc::Scheduler& scheduler = vrpc::init<vrpc::Scheduler>();
+    uint8_t priority;
+    const char* reason = scheduler.admit(method, priority);
+    // built-in functions stay callable to recover from an exceeded budget
+    if (reason == nullptr && !VrpcAgent::is_builtin(context) &&
+        vrpc::init<vrpc::Traffic>().restricts(REFUSE_CALLS) &&
+        priority < vrpc::init<vrpc::Traffic>().min_priority) {
+      reason = "data budget exceeded";
+    }
+    const uint8_t flags = is_broadcast ? vrpc::Scheduler::BROADCAST : 0;
+    if (reason != nullptr) {
+      Serial.print("ERROR [VRPC] Busy, not calling: ");
+      Serial.println(method);
+      j["e"] = arena.concat("Busy: ", reason);
+      reply(j, entry, flags);
+    } else if (!scheduler.push(j, priority, flags)) {
+      Serial.print("ERROR [VRPC] Request too large, not calling: ");
+      Serial.println(method);
+      j["e"] = "Request too large";
+      reply(j, entry, flags);
+    }
+  }
+
+  static void process_pending_calls() {
+    vrpc::Scheduler& scheduler = vrpc::init<vrpc::Scheduler>();
+    const unsigned long start = micros();
+#ifdef VRPC_THREADED
+    vrpc::Worker& worker = vrpc::init<vrpc::Worker>();
+    while (vrpc::Worker::Slot* slot = worker.collect()) {
+      vrpc::Arena::Scope scope;
+      finish_call(slot->json, slot->flags);
+      worker.release(*slot);
+    }
+#endif
+    while (scheduler.ready()) {
+      vrpc::Arena::Scope scope;
+#ifdef VRPC_THREADED
+      vrpc::Worker::Slot* slot = worker.acquire();
+      if (slot == nullptr) {
+        // the worker catches up, calls stay queued by priority
+        break;
+      }
+      vrpc::Json& j = slot->json;
+#else
+      vrpc::Json j(VRPC_JSON_CAPACITY);
+#endif
+      uint8_t flags = 0;
+      scheduler.pop(j, flags);
+      if (!(flags & vrpc::Scheduler::EXECUTED)) {
+        Serial.print("Going to call: ");
+        Serial.println(j["f"] | "");
+#ifdef VRPC_THREADED
+        // built-in functions work on state owned by this thread
+        if (!VrpcAgent::is_builtin(j["c"] | "")) {
+          worker.submit(*slot, flags);
+          continue;
+        }
+#endif
+        vrpc::Registry::call(j);
+      }
+      finish_call(j, flags);
+      if (scheduler.get_budget() != 0 &&
+          micros() - start >= scheduler.get_budget()) {
+        break;
+      }
+    }
+  }
+
+  // Replies to an executed call, unless the reply is jittered
+  static void finish_call(vrpc::Json& j, uint8_t flags) {
+    const vrpc::Broadcast& broadcast = vrpc::init<vrpc::Broadcast>();
+    // a jittered broadcast reply waits in the reply slot until it is due,
+    // the jitter is derived from the agent's unique id as random() is not
+    // seeded and would be the same on all boards running this firmware
+    if (!(flags & vrpc::Scheduler::EXECUTED) &&
+        (flags & vrpc::Scheduler::BROADCAST) && broadcast.reply &&
+        broadcast.max_jitter > 0 &&
+        vrpc::init<vrpc::Scheduler>().push(
+            j, 0, flags | vrpc::Scheduler::EXECUTED,
+            vrpc::hash(j["i"] | "", vrpc::hash(broadcast.agent)) %
+                (broadcast.max_jitter + 1))) {
+      return;
+    }
+    reply(j, vrpc::Registry::find(j["c"] | "", j["f"] | ""), flags);
+  }
+
+  static bool is_builtin(const char* context) {
+    return strcmp(context, "VrpcAgent") == 0;
+  }
+
+  static void reply(vrpc::Json& j, vrpc::FunctionEntry* entry, uint8_t flags) {
+    if (!j["e"].isNull() && !VrpcAgent::is_builtin(j["c"] | "") &&
+        vrpc::init<vrpc::Traffic>().restricts(SILENT_ERRORS)) {
+      return;
+    }
+    if (flags & vrpc::Scheduler::BROADCAST) {
+      if (!vrpc::init<vrpc::Broadcast>().reply)
+        return;
+      j["agent"] = vrpc::init<vrpc::Broadcast>().agent;
+    }
+    vrpc::Arena& arena = vrpc::Arena::current();
+    const char* sender = arena.copy(j["s"] | "");
     j.remove("s");
     j.remove("c");
     j.remove("f");
-    String res;
-    serializeJson(j, res);
-    vrpc::client.publish(sender.c_str(), res.c_str());
+    const size_t size = measureJson(j) + 1;
+    char* res = static_cast<char*>(arena.allocate(size));
+    if (sender == nullptr || res == nullptr) {
+      Serial.println("ERROR [VRPC] Not enough memory to reply");
+      return;
+    }
+    serializeJson(j, res, size);
+    if (vrpc::client.publish(sender, res) && entry != nullptr) {
+      entry->bytes_out += vrpc::Traffic::publish_size(strlen(sender), size - 1);
+    }
   }
 
   static String get_id_from_compile_date() {
@@ -458,47 +2257,222 @@ class VrpcAgent {
   }
 
   void publish_agent_info() {
-    String topic(_domain_agent + "/__agentInfo__");
-    String json = this->create_agent_info_payload(true);
+    const char* json = VrpcAgent::create_agent_info_payload(true);
     Serial.println("Sending AgentInfo...");
     Serial.println(json);
-    vrpc::client.publish(topic.c_str(), json.c_str(), true);
+    if (vrpc::client.publish(_info_topic, json, true)) {
+      vrpc::init<vrpc::Traffic>().overhead[vrpc::Traffic::AGENT_INFO] +=
+          vrpc::Traffic::publish_size(strlen(_info_topic), strlen(json));
+    }
   }
 
-  String create_agent_info_payload(bool isOnline) {
+  static const char* create_agent_info_payload(bool isOnline) {
     return isOnline ? "{\"status\":\"online\",\"hostname\":\"arduino-board\"}"
                     : "{\"status\":\"offline\",\"hostname\":\"arduino-board\"}";
   }
 
-  void publish_class_info(const String& class_name) {
-    String json("{\"className\":\"");
-    json += class_name +
-            "\",\"instances\":[],\"memberFunctions\":[],\"staticFunctions\":[";
-    const auto& functions = vrpc::Registry::get_static_functions(class_name);
-    for (const auto& func : functions)
-      json += "\"" + func + "\",";
-    json[json.length() - 1] = ']';
-    json += "}";
-    const String topic(_domain_agent + "/" + class_name + "/__classInfo__");
+  void publish_class_info(ClassInfo& info, const char* json) {
+    if (json == nullptr)
+      return;
     Serial.println("Sending ClassInfo...");
     Serial.println(json);
-    vrpc::client.publish(topic.c_str(), json.c_str(), true);
+    if (vrpc::client.publish(info.topic, json, true)) {
+      info.published_hash = info.hash;
+      vrpc::init<vrpc::Traffic>().overhead[vrpc::Traffic::CLASS_INFO] +=
+          vrpc::Traffic::publish_size(strlen(info.topic), strlen(json));
+    }
+  }
+
+  // Serializes the class info into the arena
+  static const char* render_class_info(const char* class_name) {
+    vrpc::Json j(VRPC_JSON_CAPACITY);
+    j["className"] = class_name;
+    j.createNestedArray("instances");
+    j.createNestedArray("memberFunctions");
+    JsonArray functions = j.createNestedArray("staticFunctions");
+    for (const char* function : vrpc::Registry::get_static_functions(class_name))
+      functions.add(function);
+    const size_t size = measureJson(j) + 1;
+    char* json = static_cast<char*>(vrpc::Arena::current().allocate(size));
+    if (json != nullptr)
+      serializeJson(j, json, size);
+    return json;
+  }
+
+  /**
+   * Renders client id and topics needed on every (re-)connect into the
+   * connect buffer, such that reconnecting does not allocate
+   */
+  void prepare_connect_buffer() {
+    const char* domain_agent = _domain_agent.c_str();
+    _buffer_size = 0;
+    _client_id = buffer_add("va3", VrpcAgent::get_unique_id().c_str());
+    _info_topic = buffer_add(domain_agent, "/__agentInfo__");
+    if (_client_id == nullptr || _info_topic == nullptr) {
+      _client_id = _info_topic = "";
+      _class_count = 0;
+      return;
+    }
+    // the client id is the agent name prefixed with "va3"
+    vrpc::init<vrpc::Broadcast>().agent = _client_id + 3;
+    prepare_broadcast_topics();
+    // the built-in functions are registered first, but the user's classes
+    // take precedence if the connect buffer runs short
+    std::vector<const char*> classes = vrpc::Registry::get_classes();
+    for (size_t i = 0; i + 1 < classes.size(); ++i) {
+      if (VrpcAgent::is_builtin(classes[i])) {
+        classes.push_back(classes[i]);
+        classes.erase(classes.begin() + i);
+        break;
+      }
+    }
+    size_t count = 0;
+    for (const char* name : classes) {
+      if (count == VRPC_MAX_CLASSES) {
+        Serial.println("ERROR [VRPC] Too many classes, not announcing all");
+        break;
+      }
+      ClassInfo& info = _class_infos[count];
+      info.name = name;
+      info.topic = buffer_add(domain_agent, "/", name, "/__classInfo__");
+      // a single wildcard subscription per class keeps reconnects cheap,
+      // calls to unknown functions are answered with an error
+      info.subscription = info.topic == nullptr
+                              ? nullptr
+                              : buffer_add(domain_agent, "/", name,
+                                           "/__static__/+");
+      if (info.subscription == nullptr) {
+        Serial.print("ERROR [VRPC] Connect buffer exhausted, increase "
+                     "VRPC_CONNECT_BUFFER_SIZE, not announcing: ");
+        Serial.println(name);
+        break;
+      }
+      // only the hash of the class info is kept, it is rendered again for
+      // publishing (which happens rarely)
+      vrpc::Arena::Scope scope;
+      const char* json = VrpcAgent::render_class_info(name);
+      info.hash = vrpc::hash(json ? json : "", vrpc::hash(info.topic));
+      // a class info that was already published is kept, unless its content
+      // changed (e.g. due to a different domain)
+      if (count >= _class_count) {
+        info.published_hash = 0;
+      }
+      ++count;
+    }
+    _class_count = count;
+  }
+
+  void prepare_broadcast_topics() {
+    _broadcast_topics = _buffer + _buffer_size;
+    _broadcast_topic_count = 0;
+    if (!vrpc::init<vrpc::Broadcast>().enabled)
+      return;
+    const char* domain = _domain.c_str();
+    if (buffer_add(domain, "/__all__/+/__static__/+") == nullptr)
+      return;
+    ++_broadcast_topic_count;
+    size_t start = 0;
+    while (start < _groups.length()) {
+      int end = _groups.indexOf(',', start);
+      if (end < 0)
+        end = _groups.length();
+      const String group = _groups.substring(start, end);
+      start = end + 1;
+      if (group.length() == 0)
+        continue;
+      if (buffer_add(domain, "/__all__.", group.c_str(),
+                     "/+/__static__/+") == nullptr) {
+        return;
+      }
+      ++_broadcast_topic_count;
+    }
+  }
+
+  bool subscribe(const char* topic) {
+    // only QoS 1 lets the broker queue calls for a sleeping agent
+    const uint8_t qos = vrpc::init<vrpc::Session>().persistent ? 1 : 0;
+    if (!vrpc::client.subscribe(topic, qos)) {
+      Serial.print("ERROR [VRPC] Could not subscribe to: ");
+      Serial.println(topic);
+      return false;
+    }
+    vrpc::init<vrpc::Traffic>().overhead[vrpc::Traffic::SUBSCRIBE] +=
+        vrpc::Traffic::subscribe_size(strlen(topic));
+    return true;
   }
 
-  static std::vector<String> tokenize(const String& input, char delim) {
-    std::vector<String> output;
-    size_t pos = 0;
-    for (size_t i = 0; i < input.length(); ++i) {
-      if (input[i] == delim) {
-        output.push_back(input.substring(pos, i));
-        pos = i + 1;
+  /**
+   * Appends the concatenation of the given strings to the connect buffer
+   * A nullptr terminates the list of strings and null-terminates the entry.
+   * @return false if the buffer is exhausted
+   */
+  bool buffer_append(const char* s1,
+                     const char* s2 = "",
+                     const char* s3 = "",
+                     const char* s4 = "",
+                     const char* s5 = "",
+                     const char* s6 = "") {
+    const char* parts[] = {s1, s2, s3, s4, s5, s6};
+    for (const char* part : parts) {
+      if (part == nullptr) {
+        if (_buffer_size == VRPC_CONNECT_BUFFER_SIZE)
+          return false;
+        _buffer[_buffer_size++] = '\0';
+        return true;
+      }
+      for (; *part; ++part) {
+        if (_buffer_size == VRPC_CONNECT_BUFFER_SIZE)
+          return false;
+        _buffer[_buffer_size++] = *part;
+      }
+    }
+    return true;
+  }
+
+  // Adds the concatenation of the given strings as null-terminated entry
+  const char* buffer_add(const char* s1,
+                         const char* s2 = "",
+                         const char* s3 = "",
+                         const char* s4 = "",
+                         const char* s5 = "") {
+    const char* start = _buffer + _buffer_size;
+    return buffer_append(s1, s2, s3, s4, s5, nullptr) ? start : nullptr;
+  }
+
+  /**
+   * Splits the input in place
+   * @return The number of tokens found, of which at most max are stored
+   */
+  static size_t tokenize(char* input, char delim, char** tokens, size_t max) {
+    size_t count = 0;
+    char* token = input;
+    for (char* it = input;; ++it) {
+      if (*it == delim || *it == '\0') {
+        const bool last = *it == '\0';
+        *it = '\0';
+        if (count < max)
+          tokens[count] = token;
+        ++count;
+        if (last)
+          break;
+        token = it + 1;
       }
     }
-    output.push_back(input.substring(pos));
-    return output;
+    return count;
   }
 };
 
+/*------------------------------ Time series ---------------------------------*/
+
+/**
+ * Records the values returned by Getter every Period milliseconds, quantized
+ * to Resolution, into a ring of Bytes bytes. The history is remotely available
+ * through the built-in function `VrpcAgent.getTimeSeries`.
+ */
+#define VRPC_TIME_SERIES(Getter, Period, Resolution, Bytes)   \
+  vrpc::TimeSeriesBuffer<Bytes> vrpcTimeSeries_##Getter(      \
+      #Getter, []() -> float { return Getter(); }, Period, Resolution);
+
 /*----------------------------- Macro utility
  * --------------------------------*/
 
@@ -510,6 +2484,11 @@ class VrpcAgent {
 
 #define VRPC_GLOBAL_FUNCTION(...) VA_SELECT(VRPC_GLOBAL_FUNCTION, __VA_ARGS__)
 
+// Forces the hash of a global function to be computed at compile time
+#define VRPC_FUNCTION_HASH(Function) \
+  notstd::integral_constant<uint32_t,  \
+                            vrpc::function_hash("__global__", #Function)>::value
+
 /*---------------------------- Zero arguments --------------------------------*/
 
 // global
@@ -518,7 +2497,8 @@ class VrpcAgent {
   const vrpc::GlobalFunctionRegistrar<                                         \
       decltype(static_cast<Ret (*)()>(Function)), &Function, Ret>              \
       vrpc::RegisterGlobalFunction<decltype(static_cast<Ret (*)()>(Function)), \
-                                   &Function, Ret>::registerAs(#Function);
+                                   &Function, Ret>::registerAs(                \
+          #Function, VRPC_FUNCTION_HASH(Function));
 
 /*----------------------------- One argument ---------------------------------*/
 
@@ -529,7 +2509,8 @@ class VrpcAgent {
       decltype(static_cast<Ret (*)(A1)>(Function)), &Function, Ret, A1> \
       vrpc::RegisterGlobalFunction<decltype(static_cast<Ret (*)(A1)>(   \
                                        Function)),                      \
-                                   &Function, Ret, A1>::registerAs(#Function);
+                                   &Function, Ret, A1>::registerAs(     \
+          #Function, VRPC_FUNCTION_HASH(Function));
 
 /*----------------------------- Two arguments --------------------------------*/
 
@@ -541,7 +2522,8 @@ class VrpcAgent {
                                       &Function, Ret, A1, A2>                \
       vrpc::RegisterGlobalFunction<                                          \
           decltype(static_cast<Ret (*)(A1, A2)>(Function)), &Function, Ret,  \
-          A1, A2>::registerAs(#Function);
+          A1, A2>::registerAs(                                               \
+          #Function, VRPC_FUNCTION_HASH(Function));
 
 /*--------------------------- Three arguments --------------------------------*/
 
@@ -553,7 +2535,8 @@ class VrpcAgent {
       A1, A2, A3>                                                           \
       vrpc::RegisterGlobalFunction<                                         \
           decltype(static_cast<Ret (*)(A1, A2, A3)>(Function)), &Function,  \
-          Ret, A1, A2, A3>::registerAs(#Function);
+          Ret, A1, A2, A3>::registerAs(                                     \
+          #Function, VRPC_FUNCTION_HASH(Function));
 
 /*---------------------------- Four arguments --------------------------------*/
 
@@ -565,7 +2548,8 @@ class VrpcAgent {
       Ret, A1, A2, A3, A4>                                                     \
       vrpc::RegisterGlobalFunction<                                            \
           decltype(static_cast<Ret (*)(A1, A2, A3, A4)>(Function)), &Function, \
-          Ret, A1, A2, A3, A4>::registerAs(#Function);
+          Ret, A1, A2, A3, A4>::registerAs(                                    \
+          #Function, VRPC_FUNCTION_HASH(Function));
 
 /*---------------------------- Five arguments --------------------------------*/
 
@@ -577,7 +2561,8 @@ class VrpcAgent {
       Ret, A1, A2, A3, A4, A5>                                                 \
       vrpc::RegisterGlobalFunction<                                            \
           decltype(static_cast<Ret (*)(A1, A2, A3, A4, A5)>(Function)),        \
-          &Function, Ret, A1, A2, A3, A4, A5>::registerAs(#Function);
+          &Function, Ret, A1, A2, A3, A4, A5>::registerAs(                     \
+          #Function, VRPC_FUNCTION_HASH(Function));
 
 /*----------------------------- Six arguments --------------------------------*/
 
@@ -589,6 +2574,7 @@ class VrpcAgent {
       &Function, Ret, A1, A2, A3, A4, A5, A6>                               \
       vrpc::RegisterGlobalFunction<                                         \
           decltype(static_cast<Ret (*)(A1, A2, A3, A4, A5, A6)>(Function)), \
-          &Function, Ret, A1, A2, A3, A4, A5, A6>::registerAs(#Function);
+          &Function, Ret, A1, A2, A3, A4, A5, A6>::registerAs(              \
+          #Function, VRPC_FUNCTION_HASH(Function));
 
 #endif